@@ -1,112 +1,257 @@
 #include <string.h>
-#include <math.h>
 #include "apu.h"
+#include "pace.h"
+#include "capture.h"
 
-#define CYCLES_PER_SEC      4194304
-#define MS_PER_CYCLE        0.00023841857f
+/* Charge kept by the output capacitor per sample. */
+#define APU_HIGHPASS        0.996f
+#define APU_VOLUME          0.5f
 
-static float mix(float a, float b) {
-    return (a + b) / 2;
-}
+/*
+ *  Dynamic rate control: the sample rate is adjusted by up to
+ *  APU_RATE_RANGE, all of it APU_FILL_BAND samples away from
+ *  APU_FILL_TARGET. The target leaves room for a device buffer and a
+ *  frame's samples. The fill is averaged over about APU_FILL_CYCLES of
+ *  emulated time (a quarter second), however often the APU syncs.
+ */
+#define APU_RATE_RANGE      0.005f
+#define APU_FILL_TARGET     (AUDIO_BUFSIZ * 2)
+#define APU_FILL_BAND       (AUDIO_BUFSIZ / 2)
+#define APU_FILL_CYCLES     (PACE_CYCLES_PER_SEC / 4)
 
-void sdl_apu_callback(void *user, uint8_t *stream, int len) {
-    struct apu *apu = (struct apu *)user;
-    float *fstream = (float *)((void *)stream);
+/* Level of all four channels at full volume, in both terminals. */
+#define APU_LEVEL_MAX       (2 * 4 * 15 * 8)
 
-    memset(stream, 0, (size_t)len);
+/*** Private ***/
 
-    for(int i = 0; i < len / 4; i++) {
-        int sample = apu->sample++;
+/* Hand the samples made so far to the callback, dropping what doesn't fit. */
+static void apu_flush(struct apu *apu) {
+    uint32_t n = (uint32_t)apu->pcm_len;
+    apu->overruns += n - ring_write(&apu->ring, apu->pcm, n);
+    apu->pcm_len = 0;
+}
 
-        float out = 1.0;
+/*
+ *  Each channel's DAC turns 0 - 15 into -15 - 15 (0 when the DAC is off),
+ *  NR51 routes it to the left and right terminals and NR50 sets their
+ *  volume 1 - 8. Both terminals are mixed to mono. A change from the last
+ *  level goes to the blip buffer at time cycles into the frame.
+ */
+static void apu_level(struct apu *apu, const uint32_t time) {
+    if(apu->dev == 0) {
+        return;
+    }
 
-        if(apu->sound1.on) {
-            out = mix(out, sound_generate(&apu->sound1, sample));
+    const struct sound *channels[4] = { &apu->sound1, &apu->sound2, &apu->sound3, &apu->sound4 };
+    int left = 0;
+    int right = 0;
+    for(int i = 0; i < 4; i++) {
+        if(!channels[i]->dac) {
+            continue;
         }
-
-        if(apu->sound2.on) {
-            out = mix(out, sound_generate(&apu->sound2, sample));
+        int v = sound_output(channels[i]) * 2 - 15;
+        if(apu->reg_nr51 & (0x10 << i)) {
+            left += v;
+        }
+        if(apu->reg_nr51 & (0x01 << i)) {
+            right += v;
         }
+    }
+    int level = left * (((apu->reg_nr50 >> 4) & 0x07) + 1) + right * ((apu->reg_nr50 & 0x07) + 1);
 
-        fstream[i] = out * 0.01f;
+    blip_add_delta(&apu->blip, time, level - apu->level);
+    if(apu->recording) {
+        blip_add_delta(&apu->record, time, level - apu->level);
     }
+    apu->level = level;
 }
 
-void apu_init(struct apu *apu) {
-    memset(apu, 0, sizeof(struct apu));
-    apu->reg_nr52 = 0xF1;
+/* A sample of blip's level through the output capacitor. */
+static float apu_filter(float *highpass, const int32_t level) {
+    float in = (float)level / (float)(APU_LEVEL_MAX << BLIP_UNIT);
+    float out = in - *highpass;
+    *highpass = in - out * APU_HIGHPASS;
+    return out * APU_VOLUME;
+}
 
-    SDL_AudioSpec want, have;
-    memset(&want, 0, sizeof(SDL_AudioSpec));
-    want.freq = SAMPLES_PER_SEC;
-    want.format = AUDIO_F32;
-    want.channels = CHANNELS;
-    want.samples = AUDIO_BUFSIZ;
-    want.callback = sdl_apu_callback;
-    want.userdata = apu;
+/*
+ *  The capture gets the sound at the device's nominal rate, from a blip
+ *  buffer of its own: rate control bends the device's stream, the
+ *  recording stays on the emulated timeline with the frames. Checked
+ *  before each batch, it starts from silence.
+ */
+static void apu_record_check(struct apu *apu) {
+    int recording = apu->dev != 0 && capture_has_audio(apu->capture);
+    if(recording && !apu->recording) {
+        blip_init(&apu->record, PACE_CYCLES_PER_SEC, (uint32_t)apu->freq);
+        blip_add_delta(&apu->record, 0, apu->level);
+        apu->record_highpass = 0.0f;
+    }
+    apu->recording = recording;
+}
 
-    apu->dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FORMAT_CHANGE);
-    if(apu->dev == 0) {
-        fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
+static void apu_record(struct apu *apu, const uint32_t cycles) {
+    if(!apu->recording) {
         return;
     }
 
-    SDL_PauseAudioDevice(apu->dev, 0);
+    float pcm[APU_PCM_SIZE];
+    int32_t samples[APU_PCM_SIZE];
+    int n;
+    blip_end_frame(&apu->record, cycles);
+    while((n = blip_read(&apu->record, samples, APU_PCM_SIZE)) > 0) {
+        for(int i = 0; i < n; i++) {
+            pcm[i] = apu_filter(&apu->record_highpass, samples[i]);
+        }
+        capture_audio(apu->capture, pcm, n);
+    }
 }
 
-void apu_cleanup(struct apu *apu) {
-    if(apu->dev != 0) {
-        SDL_CloseAudioDevice(apu->dev);
+/*
+ *  The emulation and the device don't run off the same clock (nor exactly
+ *  at the same rate with vsync pacing), so the ring would slowly run dry
+ *  or overflow. Make a little more sound when it is below the target and
+ *  a little less above. The fill jumps by whole device buffers and
+ *  frames, its average steers.
+ */
+static void apu_rate(struct apu *apu, const uint32_t cycles) {
+    float fill = (float)(ring_fill(&apu->ring) + (uint32_t)apu->pcm_len);
+    apu->fill += (fill - apu->fill) * ((float)cycles / APU_FILL_CYCLES);
+
+    float adjust = (APU_FILL_TARGET - apu->fill) / APU_FILL_BAND * APU_RATE_RANGE;
+    if(adjust > APU_RATE_RANGE) {
+        adjust = APU_RATE_RANGE;
+    } else if(adjust < -APU_RATE_RANGE) {
+        adjust = -APU_RATE_RANGE;
     }
+    blip_set_rate(&apu->blip, PACE_CYCLES_PER_SEC, apu->freq * (1.0 + adjust));
 }
 
-void apu_update(struct apu *apu, int cycles) {
-    float ms = cycles * MS_PER_CYCLE;
-    sound_update(&apu->sound1, ms);
-    sound_update(&apu->sound2, ms);
+/* End the blip frame after cycles and filter its samples into the ring. */
+static void apu_output(struct apu *apu, const uint32_t cycles) {
+    if(apu->dev == 0) {
+        return;
+    }
+
+    blip_end_frame(&apu->blip, cycles);
+    int32_t samples[APU_PCM_SIZE];
+    int n;
+    while((n = blip_read(&apu->blip, samples, APU_PCM_SIZE - apu->pcm_len)) > 0) {
+        for(int i = 0; i < n; i++) {
+            apu->pcm[apu->pcm_len++] = apu_filter(&apu->highpass, samples[i]);
+        }
+        if(apu->pcm_len == APU_PCM_SIZE) {
+            apu_flush(apu);
+        }
+    }
+    apu_rate(apu, cycles);
+    apu_record(apu, cycles);
 }
 
-uint8_t apu_rb(struct apu *apu, const uint16_t addr) {
-    switch(addr) {
-        case 0xFF10: return apu->reg_nr10;
-        case 0xFF11: return apu->reg_nr11;
-        case 0xFF12: return apu->reg_nr12;
-        case 0xFF13: return apu->reg_nr13;
-        case 0xFF14: return apu->reg_nr14;
+static void apu_sequence(struct apu *apu) {
+    uint8_t step = apu->seq_step;
+    apu->seq_step = (step + 1) & 0x07;
 
-        case 0xFF16: return apu->reg_nr21;
-        case 0xFF17: return apu->reg_nr22;
-        case 0xFF18: return apu->reg_nr23;
-        case 0xFF19: return apu->reg_nr24;
+    if((step & 0x01) == 0) {
+        sound_clock_len(&apu->sound1);
+        sound_clock_len(&apu->sound2);
+        sound_clock_len(&apu->sound3);
+        sound_clock_len(&apu->sound4);
+    }
+    if(step == 2 || step == 6) {
+        sound_clock_sweep(&apu->sound1);
+    }
+    if(step == 7) {
+        sound_clock_env(&apu->sound1);
+        sound_clock_env(&apu->sound2);
+        sound_clock_env(&apu->sound4);
+    }
+}
 
-        case 0xFF1A: return apu->reg_nr30;
-        case 0xFF1B: return apu->reg_nr31;
-        case 0xFF1C: return apu->reg_nr32;
-        case 0xFF1D: return apu->reg_nr33;
-        case 0xFF1E: return apu->reg_nr34;
+/*
+ *  Run cycles, from one event to the next. Only the events change the
+ *  output, each one's level goes to the blip buffer at its exact cycle.
+ */
+static void apu_run(struct apu *apu, const uint32_t cycles) {
+    struct sound *channels[4] = { &apu->sound1, &apu->sound2, &apu->sound3, &apu->sound4 };
+    int power = apu->reg_nr52 & 0x80;
+    apu_record_check(apu);
 
-        case 0xFF20: return apu->reg_nr41;
-        case 0xFF21: return apu->reg_nr42;
-        case 0xFF22: return apu->reg_nr43;
-        case 0xFF23: return apu->reg_nr44;
+    uint32_t time = 0;
+    while(time < cycles) {
+        uint32_t n = cycles - time;
+        if(power && apu->seq_timer < n) {
+            n = apu->seq_timer;
+        }
+        for(int i = 0; i < 4; i++) {
+            if(channels[i]->on && channels[i]->timer < n) {
+                n = channels[i]->timer;
+            }
+        }
+        time += n;
 
-        case 0xFF24: return apu->reg_nr50;
-        case 0xFF25: return apu->reg_nr51;
-        case 0xFF26: return apu->reg_nr52;
+        int event = 0;
+        for(int i = 0; i < 4; i++) {
+            if(channels[i]->on && (channels[i]->timer -= n) == 0) {
+                sound_step(channels[i]);
+                event = 1;
+            }
+        }
+        if(power && (apu->seq_timer -= n) == 0) {
+            apu->seq_timer = APU_SEQ_PERIOD;
+            apu_sequence(apu);
+            event = 1;
+        }
+        if(event) {
+            apu_level(apu, time);
+        }
     }
-    return 0;
+    apu_output(apu, cycles);
 }
 
-void apu_wb(struct apu *apu, const uint16_t addr, const uint8_t b) {
+/* All registers but NR52 are cleared, the length counters are kept. */
+static void apu_power_off(struct apu *apu) {
+    uint16_t len[4] = { apu->sound1.len, apu->sound2.len, apu->sound3.len, apu->sound4.len };
+    for(uint16_t addr = 0xFF10; addr <= 0xFF25; addr++) {
+        apu_wb(apu, addr, 0);
+    }
+    apu->sound1.len = len[0];
+    apu->sound2.len = len[1];
+    apu->sound3.len = len[2];
+    apu->sound4.len = len[3];
+}
+
+static void apu_power_on(struct apu *apu) {
+    apu->seq_step = 0;
+    apu->seq_timer = APU_SEQ_PERIOD;
+    apu->sound1.pos = 0;
+    apu->sound2.pos = 0;
+    apu->sound3.pos = 0;
+}
 
-    /* Ignore writes to registers when sound is off. */
+static void apu_write(struct apu *apu, const uint16_t addr, const uint8_t b) {
+    if(addr >= 0xFF30 && addr < 0xFF40) {
+        apu->wave_ram[addr & 0x0F] = b;
+        return;
+    }
+
+    /* Ignore writes to registers when sound is off, but for the lengths. */
     if((apu->reg_nr52 & 0x80) == 0 && addr != 0xFF26) {
+        switch(addr) {
+            case 0xFF11: sound_set_len(&apu->sound1, b & 0x3F); break;
+            case 0xFF16: sound_set_len(&apu->sound2, b & 0x3F); break;
+            case 0xFF1B: sound_set_len(&apu->sound3, b); break;
+            case 0xFF20: sound_set_len(&apu->sound4, b); break;
+        }
         return;
     }
 
+    /* The next step won't clock the lengths. */
+    int first_half = apu->seq_step & 0x01;
+
     switch(addr) {
         case 0xFF10:
-            apu->reg_nr10 = b & 0x7F;
+            apu->reg_nr10 = b;
             sound_set_sweep(&apu->sound1, b);
             break;
         case 0xFF11:
@@ -122,8 +267,8 @@ void apu_wb(struct apu *apu, const uint16_t addr, const uint8_t b) {
             sound_set_lo(&apu->sound1, b);
             break;
         case 0xFF14:
-            apu->reg_nr14 = b & 0xC7;
-            sound_set_hi(&apu->sound1, b);
+            apu->reg_nr14 = b;
+            sound_set_hi(&apu->sound1, b, first_half);
             break;
 
         case 0xFF16:
@@ -139,33 +284,218 @@ void apu_wb(struct apu *apu, const uint16_t addr, const uint8_t b) {
             sound_set_lo(&apu->sound2, b);
             break;
         case 0xFF19:
-            apu->reg_nr24 = b & 0xC7;
-            sound_set_hi(&apu->sound2, b);
+            apu->reg_nr24 = b;
+            sound_set_hi(&apu->sound2, b, first_half);
             break;
 
-        case 0xFF1A: apu->reg_nr30 = b & 0x80; break;
-        case 0xFF1B: apu->reg_nr31 = b; break;
-        case 0xFF1C: apu->reg_nr32 = b & 0x40; break;
-        case 0xFF1D: apu->reg_nr33 = b; break;
-        case 0xFF1E: apu->reg_nr34 = b & 0xC7; break;
+        case 0xFF1A:
+            apu->reg_nr30 = b;
+            sound_set_dac(&apu->sound3, b & 0x80);
+            break;
+        case 0xFF1B:
+            apu->reg_nr31 = b;
+            sound_set_len(&apu->sound3, b);
+            break;
+        case 0xFF1C:
+            apu->reg_nr32 = b;
+            apu->sound3.wave_vol = (b >> 5) & 0x03;
+            break;
+        case 0xFF1D:
+            apu->reg_nr33 = b;
+            sound_set_lo(&apu->sound3, b);
+            break;
+        case 0xFF1E:
+            apu->reg_nr34 = b;
+            sound_set_hi(&apu->sound3, b, first_half);
+            break;
 
-        case 0xFF20: apu->reg_nr41 = b & 0x3F; break;
-        case 0xFF21: apu->reg_nr42 = b; break;
-        case 0xFF22: apu->reg_nr43 = b; break;
-        case 0xFF23: apu->reg_nr44 = b & 0xC0; break;
+        case 0xFF20:
+            apu->reg_nr41 = b;
+            sound_set_len(&apu->sound4, b);
+            break;
+        case 0xFF21:
+            apu->reg_nr42 = b;
+            sound_set_env(&apu->sound4, b);
+            break;
+        case 0xFF22:
+            apu->reg_nr43 = b;
+            sound_set_noise(&apu->sound4, b);
+            break;
+        case 0xFF23:
+            apu->reg_nr44 = b;
+            sound_set_hi(&apu->sound4, b, first_half);
+            break;
 
         case 0xFF24:
             apu->reg_nr50 = b;
             break;
         case 0xFF25:
             apu->reg_nr51 = b;
-            apu->sound1.out_so1 = (b & 0x01);
-            apu->sound2.out_so1 = (b & 0x02);
-            apu->sound1.out_so2 = (b & 0x10);
-            apu->sound2.out_so2 = (b & 0x20);
             break;
         case 0xFF26:
-            apu->reg_nr52 = b & 0x8F;
+            if((b & 0x80) == 0 && (apu->reg_nr52 & 0x80)) {
+                apu_power_off(apu);
+            } else if((b & 0x80) && (apu->reg_nr52 & 0x80) == 0) {
+                apu_power_on(apu);
+            }
+            apu->reg_nr52 = b & 0x80;
             break;
     }
 }
+
+void sdl_apu_callback(void *user, uint8_t *stream, int len) {
+    struct apu *apu = (struct apu *)user;
+    float *fstream = (float *)((void *)stream);
+    int n = len / (int)sizeof(float);
+
+    int count = 0;
+    if(apu->filling && ring_fill(&apu->ring) >= APU_FILL_TARGET) {
+        apu->filling = 0;
+        apu->started = 1;
+    }
+    if(!apu->filling) {
+        count = (int)ring_read(&apu->ring, fstream, (uint32_t)n);
+    }
+
+    /* Ran dry: hold the last level rather than click, until refilled. */
+    if(count > 0) {
+        apu->last = fstream[count - 1];
+    }
+    for(int i = count; i < n; i++) {
+        fstream[i] = apu->last;
+    }
+    if(count < n && apu->started) {
+        atomic_fetch_add_explicit(&apu->underruns, (unsigned)(n - count), memory_order_relaxed);
+    }
+    if(count < n) {
+        apu->filling = 1;
+    }
+
+    apu->played += (uint64_t)len / (sizeof(float) * CHANNELS);
+    apu->played_at = pace_now();
+}
+
+/*** Public ***/
+
+void apu_init(struct apu *apu, struct capture *capture) {
+    memset(apu, 0, sizeof(struct apu));
+    apu->capture = capture;
+    apu->seq_timer = APU_SEQ_PERIOD;
+    sound_init(&apu->sound1, SOUND_SQUARE, apu->wave_ram);
+    sound_init(&apu->sound2, SOUND_SQUARE, apu->wave_ram);
+    sound_init(&apu->sound3, SOUND_WAVE, apu->wave_ram);
+    sound_init(&apu->sound4, SOUND_NOISE, apu->wave_ram);
+    apu->sound1.sweep = 1;
+    apu->fill = APU_FILL_TARGET;
+    apu->filling = 1;
+    if(ring_init(&apu->ring, APU_RING_SIZE) != 0) {
+        return;
+    }
+
+    SDL_AudioSpec want, have;
+    memset(&want, 0, sizeof(SDL_AudioSpec));
+    want.freq = SAMPLES_PER_SEC;
+    want.format = AUDIO_F32;
+    want.channels = CHANNELS;
+    want.samples = AUDIO_BUFSIZ;
+    want.callback = sdl_apu_callback;
+    want.userdata = apu;
+
+    /* SDL converts to whatever the device wants. */
+    apu->dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, 0);
+    if(apu->dev == 0) {
+        fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
+        return;
+    }
+
+    apu->freq = have.freq;
+    blip_init(&apu->blip, PACE_CYCLES_PER_SEC, (uint32_t)have.freq);
+    apu->buffer_ns = (uint64_t)have.samples * 1000000000ULL / (uint64_t)have.freq;
+    apu->played_at = pace_now();
+    SDL_PauseAudioDevice(apu->dev, 0);
+}
+
+void apu_cleanup(struct apu *apu) {
+    if(apu->dev != 0) {
+        SDL_CloseAudioDevice(apu->dev);
+        unsigned underruns = atomic_load(&apu->underruns);
+        if(underruns > 0 || apu->overruns > 0) {
+            fprintf(stderr, "apu: %u samples underrun, %u overrun\n", underruns, apu->overruns);
+        }
+    }
+    ring_cleanup(&apu->ring);
+}
+
+void apu_update(struct apu *apu, int cycles) {
+    apu->cycles += (uint32_t)cycles;
+    if(apu->cycles >= APU_BATCH) {
+        apu_sync(apu);
+    }
+}
+
+/* Catch up with the CPU, at most APU_BATCH cycles per blip frame. */
+void apu_sync(struct apu *apu) {
+    while(apu->cycles > 0) {
+        uint32_t n = apu->cycles < APU_BATCH ? apu->cycles : APU_BATCH;
+        apu_run(apu, n);
+        apu->cycles -= n;
+    }
+}
+
+/*
+ *  Nanoseconds of sound played. The count only moves when the device asks
+ *  for a buffer, in between the time since then is added, up to one
+ *  buffer.
+ */
+uint64_t apu_clock(struct apu *apu) {
+    SDL_LockAudioDevice(apu->dev);
+    uint64_t played = apu->played;
+    uint64_t at = apu->played_at;
+    SDL_UnlockAudioDevice(apu->dev);
+
+    uint64_t since = pace_now() - at;
+    if(since > apu->buffer_ns) {
+        since = apu->buffer_ns;
+    }
+    return played * 1000000000ULL / (uint64_t)apu->freq + since;
+}
+
+uint8_t apu_rb(struct apu *apu, const uint16_t addr) {
+    apu_sync(apu);
+
+    /* Write only bits and unused registers read as 1. */
+    switch(addr) {
+        case 0xFF10: return apu->reg_nr10 | 0x80;
+        case 0xFF11: return apu->reg_nr11 | 0x3F;
+        case 0xFF12: return apu->reg_nr12;
+        case 0xFF14: return apu->reg_nr14 | 0xBF;
+
+        case 0xFF16: return apu->reg_nr21 | 0x3F;
+        case 0xFF17: return apu->reg_nr22;
+        case 0xFF19: return apu->reg_nr24 | 0xBF;
+
+        case 0xFF1A: return apu->reg_nr30 | 0x7F;
+        case 0xFF1C: return apu->reg_nr32 | 0x9F;
+        case 0xFF1E: return apu->reg_nr34 | 0xBF;
+
+        case 0xFF21: return apu->reg_nr42;
+        case 0xFF22: return apu->reg_nr43;
+        case 0xFF23: return apu->reg_nr44 | 0xBF;
+
+        case 0xFF24: return apu->reg_nr50;
+        case 0xFF25: return apu->reg_nr51;
+        case 0xFF26:
+            return apu->reg_nr52 | 0x70 | apu->sound1.on | apu->sound2.on << 1 |
+                apu->sound3.on << 2 | apu->sound4.on << 3;
+    }
+    if(addr >= 0xFF30 && addr < 0xFF40) {
+        return apu->wave_ram[addr & 0x0F];
+    }
+    return 0xFF;
+}
+
+void apu_wb(struct apu *apu, const uint16_t addr, const uint8_t b) {
+    apu_sync(apu);
+    apu_write(apu, addr, b);
+    apu_level(apu, 0);
+}
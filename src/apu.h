@@ -1,13 +1,56 @@
+/*
+ *  apu.h
+ *  =====
+ *
+ *  The sound hardware: four channels (see sound.h), clocked by a 512 Hz
+ *  frame sequencer, mixed through NR50/NR51 and the output capacitor
+ *  (a high-pass filter) into mono samples at SAMPLES_PER_SEC.
+ *
+ *      step    0   1   2   3   4   5   6   7
+ *      length  x       x       x       x
+ *      sweep           x               x
+ *      envelope                            x
+ *
+ *  apu_update() only adds up cycles. The APU runs them in one batch,
+ *  skipping from event to event (frequency timers, sequencer steps),
+ *  when a register is accessed or APU_BATCH cycles have gone by. Each
+ *  event or register write that changes the mixed level adds the change
+ *  at its cycle to a blip buffer (see blip.h), which makes the samples
+ *  of the batch at its end. Samples are handed to the audio callback in
+ *  blocks of APU_PCM_SIZE through a lock-free ring (see ring.h). The
+ *  callback only copies out of it. It plays silence until the ring holds
+ *  APU_FILL_TARGET samples, at the start and again whenever it runs dry,
+ *  so emulation starting or catching up refills it instead of crackling.
+ *  Samples the callback had to make up (underrun) and samples that did
+ *  not fit (overrun) are counted, not the silence before the first fill.
+ *
+ *  The rate samples are made at follows the ring: up to 0.5% faster when
+ *  it runs low, slower when it fills up (dynamic rate control). This
+ *  absorbs the drift between the emulation's pacing and the device's
+ *  clock, so a short device buffer doesn't run dry. A recording (see
+ *  capture.h) gets the same changes in a second blip buffer at the fixed
+ *  rate, so its sound keeps time with the emulated frames.
+ *
+ */
 #ifndef GBOY_APU_H
 #define GBOY_APU_H
 
 #include <inttypes.h>
 #include <SDL2/SDL.h>
 #include "sound.h"
+#include "ring.h"
+#include "blip.h"
 
 #define SAMPLES_PER_SEC     48000
 #define CHANNELS            1
-#define AUDIO_BUFSIZ        4096
+#define AUDIO_BUFSIZ        1024
+
+#define APU_SEQ_PERIOD      8192                /* Cycles per sequencer step. */
+#define APU_BATCH           4096
+#define APU_PCM_SIZE        256
+#define APU_RING_SIZE       (AUDIO_BUFSIZ * 8)  /* A power of 2. */
+
+struct capture;
 
 struct apu {
     uint8_t reg_nr10;       /* 0xFF10 - Sound 1 Sweep */
@@ -39,16 +82,45 @@ struct apu {
     uint8_t wave_ram[0x10]; /* 0xFF30 - 0xFF40 */
 
     SDL_AudioDeviceID dev;
+    int freq;               /* Samples per second of the device. */
+    uint64_t buffer_ns;     /* Length of one device buffer. */
+    uint64_t played;        /* Samples handed to the device... */
+    uint64_t played_at;     /* ...as of this time (pace_now()). */
 
-    uint16_t sample;
+    struct capture *capture;    /* Gets a copy of the sound... */
+    struct blip record;         /* ...made here, at the nominal rate. */
+    float record_highpass;
+    int recording;
 
     struct sound sound1;
     struct sound sound2;
+    struct sound sound3;
+    struct sound sound4;
+
+    uint32_t cycles;        /* Not run yet. */
+    uint32_t seq_timer;
+    uint8_t seq_step;       /* Next frame sequencer step. */
+    struct blip blip;
+    int level;              /* Mixed output, as last added to blip. */
+    float fill;             /* Samples in the ring, averaged. */
+    float highpass;         /* Charge of the output capacitor. */
+
+    float pcm[APU_PCM_SIZE];
+    int pcm_len;
+
+    struct ring ring;           /* To the callback. */
+    float last;                 /* Callback: last sample played. */
+    int filling;                /* Callback: waiting for the target fill. */
+    int started;                /* Callback: played any sound yet. */
+    atomic_uint underruns;      /* Samples made up by the callback. */
+    uint32_t overruns;          /* Samples dropped, the ring was full. */
 };
 
-void        apu_init(struct apu *apu);
+void        apu_init(struct apu *apu, struct capture *capture);
 void        apu_cleanup(struct apu *apu);
 void        apu_update(struct apu *apu, const int cycles);
+void        apu_sync(struct apu *apu);
+uint64_t    apu_clock(struct apu *apu);
 uint8_t     apu_rb(struct apu *apu, const uint16_t addr);
 void        apu_wb(struct apu *apu, const uint16_t addr, const uint8_t b);
 
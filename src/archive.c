@@ -0,0 +1,286 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include "archive.h"
+
+#define ARCHIVE_MIN_SIZE        0x8000      /* 32 KiB, smallest cartridge. */
+#define ARCHIVE_MAX_SIZE        0x800000    /* 8 MiB, largest cartridge. */
+#define ARCHIVE_CHUNK           0x4000
+
+#define ZIP_LOCAL_MAGIC         0x04034B50
+#define ZIP_DESCRIPTOR_MAGIC    0x08074B50
+#define ZIP_FLAG_ENCRYPTED      0x0001
+#define ZIP_FLAG_DESCRIPTOR     0x0008
+#define ZIP_METHOD_STORED       0
+#define ZIP_METHOD_DEFLATE      8
+
+/*** Private ***/
+
+/* Growable output buffer. The ROM is inflated straight into this. */
+struct buffer {
+    char        *data;
+    uint32_t    size;
+    uint32_t    cap;
+};
+
+static int buffer_too_large(void) {
+    fprintf(stderr, "archive error: ROM larger than %d bytes\n", ARCHIVE_MAX_SIZE);
+    return -1;
+}
+
+/*
+ *  Make sure there is room for at least one more byte (sizes are powers
+ *  of two). A full buffer of ARCHIVE_MAX_SIZE is a valid ROM if nothing
+ *  follows, callers check that before growing it.
+ */
+static int buffer_grow(struct buffer *buf, uint32_t hint) {
+    if(buf->size < buf->cap) {
+        return 0;
+    }
+
+    uint32_t cap = buf->cap ? buf->cap * 2 : ARCHIVE_MIN_SIZE;
+    while(cap < hint && cap < ARCHIVE_MAX_SIZE) {
+        cap *= 2;
+    }
+    if(cap > ARCHIVE_MAX_SIZE) {
+        return buffer_too_large();
+    }
+
+    char *data = realloc(buf->data, cap);
+    if(data == NULL) {
+        return -1;
+    }
+    buf->data = data;
+    buf->cap = cap;
+    return 0;
+}
+
+static uint16_t le16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int is_rom_name(const char *name) {
+    const char *ext = strrchr(name, '.');
+    return ext != NULL && (strcasecmp(ext, ".gb") == 0 || strcasecmp(ext, ".gbc") == 0);
+}
+
+/* Raw and gzip files. zlib passes uncompressed files straight through. */
+static int archive_read_gzip(const char *path, struct buffer *buf) {
+    gzFile gz = gzopen(path, "rb");
+    if(gz == NULL) {
+        return -1;
+    }
+
+    for(;;) {
+        /* Full at the largest size: fine if the file ends here. */
+        if(buf->size == ARCHIVE_MAX_SIZE) {
+            char probe;
+            if(gzread(gz, &probe, 1) > 0) {
+                gzclose(gz);
+                return buffer_too_large();
+            }
+            break;
+        }
+
+        if(buffer_grow(buf, 0) != 0) {
+            gzclose(gz);
+            return -1;
+        }
+
+        int n = gzread(gz, &buf->data[buf->size], buf->cap - buf->size);
+        if(n <= 0) {
+            break;
+        }
+        buf->size += (uint32_t)n;
+    }
+
+    /* A truncated stream is reported here rather than by gzread. */
+    int err;
+    const char *msg = gzerror(gz, &err);
+    if(err != Z_OK) {
+        fprintf(stderr, "archive error: %s\n", msg);
+        gzclose(gz);
+        return -1;
+    }
+
+    gzclose(gz);
+    return 0;
+}
+
+/* Inflate a raw deflate stream of (at most) csize bytes from fp. */
+static int zip_inflate(FILE *fp, struct buffer *buf, uint32_t csize, uint32_t usize) {
+    uint8_t in[ARCHIVE_CHUNK];
+    z_stream zs;
+    memset(&zs, 0, sizeof(z_stream));
+
+    if(inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+        return -1;
+    }
+
+    int ret = Z_OK;
+    while(ret != Z_STREAM_END) {
+        if(zs.avail_in == 0) {
+            size_t n = sizeof(in);
+            if(csize != 0 && csize < n) {
+                n = csize;
+            }
+            zs.avail_in = (uInt)fread(in, 1, n, fp);
+            zs.next_in = in;
+            csize -= (csize != 0) ? zs.avail_in : 0;
+            if(zs.avail_in == 0) {
+                break;
+            }
+        }
+
+        /* Full at the largest size: only the end of the stream may follow. */
+        if(buf->size == ARCHIVE_MAX_SIZE) {
+            Bytef probe;
+            zs.next_out = &probe;
+            zs.avail_out = 1;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if(zs.avail_out == 0) {
+                buffer_too_large();
+                ret = Z_DATA_ERROR;
+                break;
+            }
+        } else {
+            if(buffer_grow(buf, usize) != 0) {
+                break;
+            }
+
+            zs.next_out = (Bytef *)&buf->data[buf->size];
+            zs.avail_out = buf->cap - buf->size;
+            ret = inflate(&zs, Z_NO_FLUSH);
+            buf->size = buf->cap - zs.avail_out;
+        }
+
+        if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "archive error: %s\n", zs.msg ? zs.msg : "inflate failed");
+            break;
+        }
+    }
+
+    /* Give back whatever was read past the end of the stream. */
+    if(zs.avail_in != 0) {
+        fseek(fp, -(long)zs.avail_in, SEEK_CUR);
+    }
+
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END ? 0 : -1;
+}
+
+/* Walk the local file headers and extract the first ROM entry. */
+static int archive_read_zip(FILE *fp, struct buffer *buf) {
+    uint8_t hdr[30];
+    char name[256];
+
+    while(fread(hdr, sizeof(hdr), 1, fp) == 1 && le32(hdr) == ZIP_LOCAL_MAGIC) {
+        uint16_t flags = le16(&hdr[6]);
+        uint16_t method = le16(&hdr[8]);
+        uint32_t crc = le32(&hdr[14]);
+        uint32_t csize = le32(&hdr[18]);
+        uint32_t usize = le32(&hdr[22]);
+        uint16_t name_len = le16(&hdr[26]);
+        uint16_t extra_len = le16(&hdr[28]);
+
+        size_t n = name_len < sizeof(name) ? name_len : sizeof(name) - 1;
+        if(fread(name, 1, n, fp) != n) {
+            return -1;
+        }
+        name[n] = '\0';
+        if(fseek(fp, (long)(name_len - n) + extra_len, SEEK_CUR) != 0) {
+            return -1;
+        }
+
+        if(!is_rom_name(name)) {
+            /* Without sizes in the local header we can not skip the entry. */
+            if(flags & ZIP_FLAG_DESCRIPTOR) {
+                break;
+            }
+            if(fseek(fp, (long)csize, SEEK_CUR) != 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if(flags & ZIP_FLAG_ENCRYPTED) {
+            fprintf(stderr, "archive error: %s is encrypted\n", name);
+            return -1;
+        }
+
+        int ret;
+        if(method == ZIP_METHOD_DEFLATE) {
+            ret = zip_inflate(fp, buf, (flags & ZIP_FLAG_DESCRIPTOR) ? 0 : csize, usize);
+        } else if(method == ZIP_METHOD_STORED && (flags & ZIP_FLAG_DESCRIPTOR) == 0) {
+            ret = buffer_grow(buf, usize);
+            if(ret == 0 && (usize > buf->cap || fread(buf->data, 1, usize, fp) != usize)) {
+                ret = -1;
+            }
+            buf->size = usize;
+        } else {
+            fprintf(stderr, "archive error: unsupported compression method %d\n", method);
+            return -1;
+        }
+
+        if(ret != 0) {
+            return -1;
+        }
+
+        /* With a data descriptor the CRC follows the data. */
+        if(flags & ZIP_FLAG_DESCRIPTOR) {
+            uint8_t desc[16];
+            if(fread(desc, sizeof(desc), 1, fp) != 1) {
+                fprintf(stderr, "archive error: truncated data descriptor\n");
+                return -1;
+            }
+            crc = le32(desc) == ZIP_DESCRIPTOR_MAGIC ? le32(&desc[4]) : le32(desc);
+        }
+
+        if(crc32(0, (const Bytef *)buf->data, buf->size) != crc) {
+            fprintf(stderr, "archive error: CRC mismatch for %s\n", name);
+            return -1;
+        }
+
+        return 0;
+    }
+
+    fprintf(stderr, "archive error: no .gb/.gbc entry found\n");
+    return -1;
+}
+
+/*** Public ***/
+
+int archive_read(const char *path, char **data, uint32_t *size) {
+    struct buffer buf = { NULL, 0, 0 };
+    uint8_t magic[4] = { 0 };
+    int ret;
+
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        return -1;
+    }
+
+    if(fread(magic, sizeof(magic), 1, fp) == 1 && le32(magic) == ZIP_LOCAL_MAGIC) {
+        rewind(fp);
+        ret = archive_read_zip(fp, &buf);
+        fclose(fp);
+    } else {
+        fclose(fp);
+        ret = archive_read_gzip(path, &buf);
+    }
+
+    if(ret != 0) {
+        free(buf.data);
+        return -1;
+    }
+
+    *data = buf.data;
+    *size = buf.size;
+    return 0;
+}
@@ -0,0 +1,24 @@
+/*
+ *  archive.h
+ *  =========
+ *
+ *  Read ROM images that may be stored compressed.
+ *
+ *  Supported formats:
+ *
+ *      raw     - a plain .gb/.gbc file.
+ *      gzip    - a .gz file (detected by magic, not by extension).
+ *      zip     - the first .gb/.gbc entry of a .zip file (stored or deflated).
+ *
+ *  The data is inflated directly into a single heap buffer while the file
+ *  is read, without any temporary files.
+ *
+ */
+#ifndef GBOY_ARCHIVE_H
+#define GBOY_ARCHIVE_H
+
+#include <inttypes.h>
+
+int     archive_read(const char *path, char **data, uint32_t *size);
+
+#endif
@@ -0,0 +1,97 @@
+#include <string.h>
+#include <math.h>
+#include "blip.h"
+
+/* Pass band as a fraction of the output rate's Nyquist frequency. */
+#define BLIP_CUTOFF     0.9
+
+/*** Private ***/
+
+/*
+ *  For a step a fraction of a sample (phase) after a sample position, the
+ *  impulse the BLIP_TAPS samples from there get: a sinc low-pass window
+ *  (Blackman), centred between the middle taps. Rounding is put on the
+ *  largest tap so each phase sums to exactly 1 << BLIP_UNIT.
+ */
+static void blip_make_kernel(struct blip *blip) {
+    for(int p = 0; p < BLIP_PHASES; p++) {
+        double h[BLIP_TAPS];
+        double sum = 0.0;
+        for(int k = 0; k < BLIP_TAPS; k++) {
+            double x = k - (BLIP_TAPS / 2 - 1) - (double)p / BLIP_PHASES;
+            double t = M_PI * BLIP_CUTOFF * x;
+            double w = 0.42 + 0.5 * cos(2.0 * M_PI * x / BLIP_TAPS) +
+                0.08 * cos(4.0 * M_PI * x / BLIP_TAPS);
+            h[k] = (x == 0.0 ? 1.0 : sin(t) / t) * w;
+            sum += h[k];
+        }
+
+        int total = 0;
+        int peak = 0;
+        for(int k = 0; k < BLIP_TAPS; k++) {
+            blip->kernel[p][k] = (int16_t)lround(h[k] / sum * (1 << BLIP_UNIT));
+            total += blip->kernel[p][k];
+            if(blip->kernel[p][k] > blip->kernel[p][peak]) {
+                peak = k;
+            }
+        }
+        blip->kernel[p][peak] += (int16_t)((1 << BLIP_UNIT) - total);
+    }
+}
+
+/*** Public ***/
+
+void blip_init(struct blip *blip, const uint32_t clock_rate, const uint32_t sample_rate) {
+    memset(blip, 0, sizeof(struct blip));
+    blip_set_rate(blip, clock_rate, sample_rate);
+    blip_make_kernel(blip);
+}
+
+/* Can change between frames, sample_rate need not be whole. */
+void blip_set_rate(struct blip *blip, const uint32_t clock_rate, const double sample_rate) {
+    blip->factor = (uint64_t)(sample_rate * 4294967296.0 / clock_rate);
+}
+
+/* A change of delta in the level at time clocks into the frame. */
+void blip_add_delta(struct blip *blip, const uint32_t time, const int delta) {
+    uint64_t pos = blip->offset + (uint64_t)time * blip->factor;
+    uint32_t at = (uint32_t)(pos >> 32);
+    if(delta == 0 || at >= BLIP_SIZE) {
+        return;
+    }
+
+    const int16_t *kernel = blip->kernel[(pos >> (32 - BLIP_PHASE_BITS)) & (BLIP_PHASES - 1)];
+    int32_t *buf = &blip->buf[at];
+    for(int k = 0; k < BLIP_TAPS; k++) {
+        buf[k] += kernel[k] * delta;
+    }
+}
+
+/* End the frame after clocks, the next one starts there. */
+void blip_end_frame(struct blip *blip, const uint32_t clocks) {
+    blip->offset += (uint64_t)clocks * blip->factor;
+}
+
+/* Whole samples up to the end of the last frame. */
+int blip_avail(const struct blip *blip) {
+    return (int)(blip->offset >> 32);
+}
+
+/* Up to n samples into out, scaled by 1 << BLIP_UNIT. Returns how many. */
+int blip_read(struct blip *blip, int32_t *out, const int n) {
+    int avail = blip_avail(blip);
+    int count = n < avail ? n : avail;
+    int32_t sum = blip->integrator;
+    for(int i = 0; i < count; i++) {
+        sum += blip->buf[i];
+        out[i] = sum;
+    }
+    blip->integrator = sum;
+
+    /* Keep the rest and the kernel tails past it. */
+    int keep = avail - count + BLIP_TAPS;
+    memmove(blip->buf, &blip->buf[count], (size_t)keep * sizeof(int32_t));
+    memset(&blip->buf[keep], 0, (size_t)count * sizeof(int32_t));
+    blip->offset -= (uint64_t)count << 32;
+    return count;
+}
@@ -0,0 +1,47 @@
+/*
+ *  blip.h
+ *  ======
+ *
+ *  Band-limited synthesis. Instead of sampling a waveform at the output
+ *  rate (which aliases), the sound hardware reports each change of its
+ *  output level as a delta at the clock cycle it happens. The delta is
+ *  added to a buffer as a band-limited step: a windowed sinc impulse,
+ *  picked from BLIP_PHASES fractional sample positions, spread over
+ *  BLIP_TAPS samples. Reading integrates the buffer into output samples.
+ *
+ *  The work is per change and per sample read, not per sample per
+ *  channel. Each phase of the kernel sums to exactly 1 << BLIP_UNIT, so
+ *  a step integrates to its full height and the level never drifts.
+ *
+ *  Times are in clocks since the start of the frame; blip_end_frame()
+ *  makes the frame's samples readable and starts the next one. Output
+ *  lags by BLIP_TAPS / 2 samples.
+ *
+ */
+#ifndef GBOY_BLIP_H
+#define GBOY_BLIP_H
+
+#include <inttypes.h>
+
+#define BLIP_PHASE_BITS 5
+#define BLIP_PHASES     (1 << BLIP_PHASE_BITS)
+#define BLIP_TAPS       16
+#define BLIP_UNIT       15          /* Kernel fixed point bits. */
+#define BLIP_SIZE       4096        /* Samples, a frame must not be longer. */
+
+struct blip {
+    uint64_t factor;                /* Samples per clock, 32.32 fixed point. */
+    uint64_t offset;                /* Sample position of the frame start, 32.32. */
+    int32_t integrator;
+    int16_t kernel[BLIP_PHASES][BLIP_TAPS];
+    int32_t buf[BLIP_SIZE + BLIP_TAPS];
+};
+
+void    blip_init(struct blip *blip, const uint32_t clock_rate, const uint32_t sample_rate);
+void    blip_set_rate(struct blip *blip, const uint32_t clock_rate, const double sample_rate);
+void    blip_add_delta(struct blip *blip, const uint32_t time, const int delta);
+void    blip_end_frame(struct blip *blip, const uint32_t clocks);
+int     blip_avail(const struct blip *blip);
+int     blip_read(struct blip *blip, int32_t *out, const int n);
+
+#endif
@@ -0,0 +1,300 @@
+#include <stdlib.h>
+#include <string.h>
+#include "capture.h"
+#include "pace.h"
+
+#define CAPTURE_FRAME_HEADER    "FRAME\n"
+#define CAPTURE_WAV_HEADER      44
+
+/*** Private ***/
+
+static void capture_write(struct capture *cap, FILE *f, const void *p, const size_t n) {
+    if(!cap->error && fwrite(p, 1, n, f) != n) {
+        fprintf(stderr, "capture error: write failed, recording stopped\n");
+        cap->error = 1;
+    }
+}
+
+static void capture_put(uint8_t *p, const uint32_t v, const int bytes) {
+    for(int i = 0; i < bytes; i++) {
+        p[i] = (uint8_t)(v >> (i * 8));
+    }
+}
+
+/* 16 bit mono PCM, the sizes are filled in when capture stops. */
+static void capture_wav_header(struct capture *cap) {
+    uint8_t h[CAPTURE_WAV_HEADER];
+    memcpy(&h[0], "RIFF", 4);
+    capture_put(&h[4], 36 + cap->audio_bytes, 4);
+    memcpy(&h[8], "WAVEfmt ", 8);
+    capture_put(&h[16], 16, 4);
+    capture_put(&h[20], 1, 2);                              /* PCM */
+    capture_put(&h[22], 1, 2);                              /* Channels */
+    capture_put(&h[24], (uint32_t)cap->sample_rate, 4);
+    capture_put(&h[28], (uint32_t)cap->sample_rate * 2, 4); /* Bytes per second */
+    capture_put(&h[32], 2, 2);                              /* Bytes per sample */
+    capture_put(&h[34], 16, 2);
+    memcpy(&h[36], "data", 4);
+    capture_put(&h[40], cap->audio_bytes, 4);
+    capture_write(cap, cap->audio, h, sizeof(h));
+}
+
+static uint8_t capture_clamp(const int v) {
+    return (uint8_t)(v > 255 ? 255 : v);
+}
+
+/* The frame into cap->out, as it is written to the file. */
+static void capture_convert(struct capture *cap, const pixel_t *frame) {
+    uint8_t *out = cap->out;
+    if(cap->format == CAPTURE_RGB) {
+        for(int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+            uint32_t c = pixel_argb(frame, i);
+            out[i * 3 + 0] = (uint8_t)(c >> 16);
+            out[i * 3 + 1] = (uint8_t)(c >> 8);
+            out[i * 3 + 2] = (uint8_t)c;
+        }
+        return;
+    }
+
+    memcpy(out, CAPTURE_FRAME_HEADER, strlen(CAPTURE_FRAME_HEADER));
+    uint8_t *y = &out[strlen(CAPTURE_FRAME_HEADER)];
+    uint8_t *cb = &y[SCREEN_WIDTH * SCREEN_HEIGHT];
+    uint8_t *cr = &cb[SCREEN_WIDTH * SCREEN_HEIGHT / 4];
+    for(int row = 0; row < SCREEN_HEIGHT; row += 2) {
+        for(int col = 0; col < SCREEN_WIDTH; col += 2) {
+            int r = 0, g = 0, b = 0;
+            for(int k = 0; k < 4; k++) {
+                int i = (row + (k >> 1)) * SCREEN_WIDTH + col + (k & 1);
+                uint32_t c = pixel_argb(frame, i);
+                int pr = (c >> 16) & 0xFF, pg = (c >> 8) & 0xFF, pb = c & 0xFF;
+                y[i] = (uint8_t)((77 * pr + 150 * pg + 29 * pb + 128) >> 8);
+                r += pr;
+                g += pg;
+                b += pb;
+            }
+
+            /* Chroma of the 2x2 average: the sums are 4x, shift by 2 more. */
+            int o = (row / 2) * (SCREEN_WIDTH / 2) + col / 2;
+            cb[o] = capture_clamp((-43 * r - 85 * g + 128 * b + (128 << 10) + 512) >> 10);
+            cr[o] = capture_clamp((128 * r - 107 * g - 21 * b + (128 << 10) + 512) >> 10);
+        }
+    }
+}
+
+/* Write the last frame n more times. */
+static void capture_repeat(struct capture *cap, uint32_t n) {
+    while(n-- > 0) {
+        capture_write(cap, cap->video, cap->out, cap->out_size);
+    }
+}
+
+static void capture_drain_video(struct capture *cap) {
+    unsigned head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&cap->tail, memory_order_acquire);
+    for(; head != tail; head++) {
+        struct capture_slot *slot = &cap->slots[head % CAPTURE_SLOTS];
+        capture_repeat(cap, slot->repeat);
+        capture_convert(cap, slot->frame);
+
+        /* The slot is free once converted, don't hold it during the write. */
+        atomic_store_explicit(&cap->head, head + 1, memory_order_release);
+        SDL_SemPost(cap->space);
+        capture_write(cap, cap->video, cap->out, cap->out_size);
+    }
+}
+
+static void capture_drain_audio(struct capture *cap) {
+    if(cap->audio == NULL) {
+        return;
+    }
+
+    int16_t pcm[1024];
+    float samples[1024];
+    uint32_t n;
+    while((n = ring_read(&cap->samples, samples, sizeof(samples) / sizeof(samples[0]))) > 0) {
+        SDL_SemPost(cap->space);
+        for(uint32_t i = 0; i < n; i++) {
+            float v = samples[i] * 32767.0f;
+            pcm[i] = (int16_t)(v > 32767.0f ? 32767.0f : (v < -32768.0f ? -32768.0f : v));
+        }
+        capture_write(cap, cap->audio, pcm, n * sizeof(int16_t));
+        cap->audio_bytes += n * (unsigned)sizeof(int16_t);
+    }
+
+    unsigned lost = atomic_exchange(&cap->samples_lost, 0);
+    memset(pcm, 0, sizeof(pcm));
+    while(lost > 0) {
+        n = lost < sizeof(pcm) / sizeof(pcm[0]) ? lost : sizeof(pcm) / sizeof(pcm[0]);
+        capture_write(cap, cap->audio, pcm, n * sizeof(int16_t));
+        cap->audio_bytes += n * (unsigned)sizeof(int16_t);
+        lost -= n;
+    }
+}
+
+static int capture_run(void *data) {
+    struct capture *cap = (struct capture *)data;
+    int quit;
+    do {
+        SDL_SemWaitTimeout(cap->wake, 100);
+        quit = atomic_load(&cap->quit);
+        capture_drain_video(cap);
+        capture_drain_audio(cap);
+    } while(!quit);
+    return 0;
+}
+
+static void capture_free(struct capture *cap) {
+    if(cap->video != NULL) {
+        fclose(cap->video);
+    }
+    if(cap->audio != NULL) {
+        fclose(cap->audio);
+    }
+    if(cap->wake != NULL) {
+        SDL_DestroySemaphore(cap->wake);
+    }
+    if(cap->space != NULL) {
+        SDL_DestroySemaphore(cap->space);
+    }
+    free(cap->slots);
+    ring_cleanup(&cap->samples);
+    free(cap->out);
+    cap->video = cap->audio = NULL;
+    cap->wake = cap->space = NULL;
+    cap->slots = NULL;
+    cap->out = NULL;
+}
+
+/*** Public ***/
+
+/*
+ *  Record to path, every is the number of emulated frames per captured
+ *  one (for the frame rate), sample_rate 0 records no sound.
+ */
+int capture_start(struct capture *cap, const char *path, enum capture_format format,
+        enum capture_policy policy, int every, int sample_rate) {
+    memset(cap, 0, sizeof(struct capture));
+    cap->format = format;
+    cap->policy = policy;
+    cap->sample_rate = sample_rate;
+    cap->out_size = (format == CAPTURE_Y4M)
+        ? strlen(CAPTURE_FRAME_HEADER) + SCREEN_WIDTH * SCREEN_HEIGHT * 3 / 2
+        : SCREEN_WIDTH * SCREEN_HEIGHT * 3;
+
+    cap->slots = malloc(CAPTURE_SLOTS * sizeof(struct capture_slot));
+    cap->out = calloc(1, cap->out_size);
+    cap->wake = SDL_CreateSemaphore(0);
+    cap->space = SDL_CreateSemaphore(0);
+    if(cap->slots == NULL || cap->out == NULL || cap->wake == NULL || cap->space == NULL) {
+        fprintf(stderr, "capture error: out of resources\n");
+        capture_free(cap);
+        return -1;
+    }
+
+    cap->video = fopen(path, "wb");
+    if(cap->video == NULL) {
+        fprintf(stderr, "capture error: can't open %s\n", path);
+        capture_free(cap);
+        return -1;
+    }
+    if(format == CAPTURE_Y4M) {
+        fprintf(cap->video, "YUV4MPEG2 W%d H%d F%d:%d Ip A1:1 C420jpeg XCOLORRANGE=FULL\n", SCREEN_WIDTH,
+            SCREEN_HEIGHT, PACE_CYCLES_PER_SEC, PACE_CYCLES_PER_FRAME * every);
+    }
+
+    if(sample_rate > 0) {
+        char wav_path[1024];
+        snprintf(wav_path, sizeof(wav_path), "%s.wav", path);
+        cap->audio = fopen(wav_path, "wb");
+        if(ring_init(&cap->samples, CAPTURE_SAMPLES) != 0 || cap->audio == NULL) {
+            fprintf(stderr, "capture error: can't open %s\n", wav_path);
+            capture_free(cap);
+            return -1;
+        }
+        capture_wav_header(cap);
+    }
+
+    cap->thread = SDL_CreateThread(capture_run, "capture", cap);
+    if(cap->thread == NULL) {
+        fprintf(stderr, "capture error: failed to create thread: %s\n", SDL_GetError());
+        capture_free(cap);
+        return -1;
+    }
+
+    cap->running = 1;
+    return 0;
+}
+
+void capture_stop(struct capture *cap) {
+    if(!cap->running) {
+        return;
+    }
+
+    atomic_store(&cap->quit, 1);
+    SDL_SemPost(cap->wake);
+    SDL_WaitThread(cap->thread, NULL);
+    cap->running = 0;
+
+    capture_repeat(cap, cap->pending);
+    if(cap->audio != NULL && fseek(cap->audio, 0, SEEK_SET) == 0) {
+        capture_wav_header(cap);
+    }
+    if(cap->error) {
+        fprintf(stderr, "capture error: recording is incomplete\n");
+    }
+    fprintf(stderr, "capture: %u frames, %u dropped\n", cap->frames, cap->dropped);
+    capture_free(cap);
+}
+
+/* Called by the emulation for each shown frame, after gpu_present(). */
+void capture_frame(struct capture *cap, const struct gpu *gpu) {
+    if(!cap->running) {
+        return;
+    }
+
+    cap->frames++;
+    if(!gpu_frame_changed(gpu, &cap->watch)) {
+        cap->pending++;
+        return;
+    }
+
+    unsigned tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+    while(tail - atomic_load_explicit(&cap->head, memory_order_acquire) == CAPTURE_SLOTS) {
+        if(cap->policy == CAPTURE_DROP) {
+            cap->dropped++;
+            cap->pending++;
+            cap->watch.gen = 0;     /* Not queued, take the next frame even if unchanged. */
+            return;
+        }
+        SDL_SemWait(cap->space);
+    }
+
+    struct capture_slot *slot = &cap->slots[tail % CAPTURE_SLOTS];
+    slot->repeat = cap->pending;
+    cap->pending = 0;
+    memcpy(slot->frame, gpu->frame, sizeof(slot->frame));
+    atomic_store_explicit(&cap->tail, tail + 1, memory_order_release);
+    SDL_SemPost(cap->wake);
+}
+
+/* Whether sound is recorded, capture_audio() wants samples. */
+int capture_has_audio(const struct capture *cap) {
+    return cap->running && cap->audio != NULL;
+}
+
+/* Called by the APU with the emulation's sound. */
+void capture_audio(struct capture *cap, const float *samples, int n) {
+    if(!capture_has_audio(cap)) {
+        return;
+    }
+
+    uint32_t count = ring_write(&cap->samples, samples, (uint32_t)n);
+    while(count < (uint32_t)n && cap->policy == CAPTURE_WAIT) {
+        SDL_SemPost(cap->wake);
+        SDL_SemWait(cap->space);
+        count += ring_write(&cap->samples, &samples[count], (uint32_t)n - count);
+    }
+    if(count < (uint32_t)n) {
+        atomic_fetch_add(&cap->samples_lost, (uint32_t)n - count);
+    }
+}
@@ -0,0 +1,103 @@
+/*
+ *  capture.h
+ *  =========
+ *
+ *  Records what the emulator shows, for QA. The emulation thread only
+ *  copies each new frame into a bounded single producer, single consumer
+ *  queue; a writer thread converts and writes it:
+ *
+ *      CAPTURE_Y4M     - YUV4MPEG2, 4:2:0 full range (BT.601, marked
+ *                        XCOLORRANGE=FULL), plays and converts with
+ *                        ffmpeg/mpv as it is.
+ *      CAPTURE_RGB     - raw RGB24 frames, for example
+ *                        ffmpeg -f rawvideo -pixel_format rgb24
+ *                               -video_size 160x144 -framerate 59.73 -i FILE
+ *
+ *  Frames are queued in the frame buffer's own format (see pixel.h), so
+ *  with PIXEL_FORMAT I2 or I8 the queue holds indexed frames and with
+ *  RGBA8888 full color ones. Frames that did not change (see
+ *  gpu_frame_changed()) are not copied, only counted, and written again by
+ *  the writer.
+ *
+ *  Sound comes from the APU on the emulation thread, at a fixed rate on
+ *  the emulated timeline like the frames (not what the device played, see
+ *  apu.h), and goes through a ring of samples to a 16 bit PCM WAV next to
+ *  the video (FILE.wav).
+ *
+ *  When the disk falls behind and the queue is full:
+ *
+ *      CAPTURE_DROP    - the frame is dropped and the last one written
+ *                        repeated in its place, so the video keeps time.
+ *      CAPTURE_WAIT    - the emulation waits for a free slot.
+ *
+ *  Sound is handled the same way: with CAPTURE_DROP samples that don't
+ *  fit are written as silence, with CAPTURE_WAIT the emulation waits.
+ *
+ */
+#ifndef GBOY_CAPTURE_H
+#define GBOY_CAPTURE_H
+
+#include <stdio.h>
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+#include "pixel.h"
+#include "screen.h"
+#include "gpu.h"
+#include "ring.h"
+
+#define CAPTURE_SLOTS       64              /* Frames, a power of 2. */
+#define CAPTURE_SAMPLES     (1 << 16)       /* Audio samples, a power of 2. */
+
+enum capture_format {
+    CAPTURE_Y4M,
+    CAPTURE_RGB,
+};
+
+enum capture_policy {
+    CAPTURE_DROP,
+    CAPTURE_WAIT,
+};
+
+struct capture_slot {
+    uint32_t repeat;        /* Write the frame before this many times first. */
+    pixel_t frame[PIXEL_OFFSET(SCREEN_WIDTH * SCREEN_HEIGHT)];
+};
+
+struct capture {
+    int running;
+    enum capture_format format;
+    enum capture_policy policy;
+    struct gpu_frame_watch watch;
+    uint32_t pending;       /* Frames to repeat, not queued yet. */
+    uint32_t frames;
+    uint32_t dropped;
+
+    FILE *video;
+    FILE *audio;
+    int sample_rate;
+    uint32_t audio_bytes;
+    int error;              /* Writing failed, the rest is thrown away. */
+    uint8_t *out;           /* Last frame written, converted. */
+    size_t out_size;
+
+    SDL_Thread *thread;
+    SDL_sem *wake;          /* A frame was queued, sound waits or capture stops. */
+    SDL_sem *space;         /* A slot or room for samples was freed. */
+    atomic_int quit;
+
+    struct capture_slot *slots;
+    atomic_uint head;       /* Next slot to write out (writer). */
+    atomic_uint tail;       /* Next slot to fill (emulation). */
+
+    struct ring samples;
+    atomic_uint samples_lost;
+};
+
+int     capture_start(struct capture *cap, const char *path, enum capture_format format,
+            enum capture_policy policy, int every, int sample_rate);
+void    capture_stop(struct capture *cap);
+void    capture_frame(struct capture *cap, const struct gpu *gpu);
+int     capture_has_audio(const struct capture *cap);
+void    capture_audio(struct capture *cap, const float *samples, int n);
+
+#endif
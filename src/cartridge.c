@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "cartridge.h"
+#include "archive.h"
 
 static const uint8_t NINTENDO_LOGO[] = {
     0xCE, 0xED, 0x66, 0x66, 0xCC, 0x0D, 0x00, 0x0B, 0x03, 0x73, 0x00, 0x83, 0x00, 0x0C, 0x00, 0x0D,
@@ -12,24 +13,18 @@ int cartridge_open(struct cartridge *cartridge, const char *path) {
     cartridge->data = NULL;
     cartridge->size = 0;
 
-    FILE *fp = fopen(path, "rb");
-    if(fp == NULL) {
+    char *data;
+    uint32_t size;
+    if(archive_read(path, &data, &size) != 0) {
         return -1;
     }
 
-    fseek(fp, 0, SEEK_END);
-    uint32_t size = (uint32_t)ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-
-    char *data = malloc(size);
-    if(fread(data, size, 1, fp) != 1) {
+    if(size < 0x8000) {
+        fprintf(stderr, "cartridge error: ROM too small (%u bytes)\n", size);
         free(data);
-        fclose(fp);
         return -1;
     }
 
-    fclose(fp);
-
     /* Verify cartridge header (start jump and logo). */
 
     struct cartridge_header *header = (struct cartridge_header *)&data[0x100];
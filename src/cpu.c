@@ -36,6 +36,7 @@ void cpu_cleanup(struct cpu *cpu) {
 
 uint16_t cpu_step(struct cpu *cpu) {
     if(cpu->halt) {
+        cpu->cycles += 4;
         return 4;
     }
 
@@ -56,6 +57,7 @@ uint16_t cpu_step(struct cpu *cpu) {
     }
 
     cycles += impl(cpu, info);
+    cpu->cycles += cycles;
     return cycles;
 }
 
@@ -55,6 +55,8 @@ struct cpu {
     int stop;
     int halt;
 
+    uint64_t cycles;        /* Total cycles executed, used as a timestamp. */
+
     struct mmu *mmu;
     struct interrupt_controller *ic;
 };
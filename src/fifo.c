@@ -0,0 +1,341 @@
+#include <string.h>
+#include "fifo.h"
+#include "gpu.h"
+#include "interrupt.h"
+#include "screen.h"
+
+#define DOTS_OAM        80
+#define DOTS_LINE       456
+
+/*** Private ***/
+
+static const struct obj *fifo_obj(const struct gpu *gpu, const int i) {
+    return (const struct obj *)&gpu->oam[gpu->fifo.objs[i] * 4];
+}
+
+/* Mode 2: select the first 10 objects (in OAM order) on the line, sorted by X. */
+static void fifo_select_objects(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+    int h = (gpu->reg_lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+
+    f->obj_count = 0;
+    for(uint8_t i = 0; i < 40 && f->obj_count < 10; i++) {
+        const struct obj *obj = (const struct obj *)&gpu->oam[i * 4];
+        int y = obj->y - 16;
+        if(gpu->reg_ly < y || gpu->reg_ly >= y + h) {
+            continue;
+        }
+
+        /* Insert after all objects with the same or lower X. */
+        int n = f->obj_count++;
+        while(n > 0 && fifo_obj(gpu, n - 1)->x > obj->x) {
+            f->objs[n] = f->objs[n - 1];
+            n--;
+        }
+        f->objs[n] = i;
+    }
+}
+
+/* Mode 3 starts with empty FIFOs and a fetcher at the left of the background. */
+static void fifo_start_line(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+
+    f->x = 0;
+    f->discard = gpu->reg_scx & 0x07;
+    f->window = 0;
+    f->bg_head = 0;
+    f->bg_len = 0;
+    memset(f->obj, 0, sizeof(f->obj));
+    memset(f->obj_prio, 0, sizeof(f->obj_prio));
+    f->fetch = FIFO_FETCH_TILE;
+    f->fetch_dots = 0;
+    f->fetch_x = 0;
+    f->dummy = 1;
+    f->obj_next = 0;
+    f->obj_stall = 0;
+    f->obj_tile = -1;
+
+    /* Skipping is decided per frame. */
+    if(gpu->reg_ly == 0) {
+        gpu->skipping = gpu->skip;
+    }
+}
+
+/* Map row (0-255) the fetcher reads from. */
+static uint8_t fifo_map_y(const struct gpu *gpu) {
+    return gpu->fifo.window ? gpu->win_line : (uint8_t)(gpu->reg_ly + gpu->reg_scy);
+}
+
+/* VRAM address of the low byte of the fetched tile row. */
+static uint16_t fifo_tile_addr(const struct gpu *gpu) {
+    uint8_t id = gpu->fifo.tile_id;
+    int base = (gpu->reg_lcdc & LCDC_BG_DATA) ? id * 16 : 0x1000 + (int8_t)id * 16;
+    return (uint16_t)(base + (fifo_map_y(gpu) & 0x07) * 2);
+}
+
+/* Advance the background fetcher one dot. It pushes 8 pixels whenever the FIFO is empty. */
+static void fifo_fetch_bg(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+
+    if(f->fetch != FIFO_FETCH_PUSH && ++f->fetch_dots == 2) {
+        f->fetch_dots = 0;
+        switch(f->fetch) {
+            case FIFO_FETCH_TILE: {
+                int window = f->window;
+                uint16_t map = (gpu->reg_lcdc & (window ? LCDC_WIN_MAP : LCDC_BG_MAP)) ? 0x1C00 : 0x1800;
+                int mx = window ? f->fetch_x : (gpu->reg_scx >> 3) + f->fetch_x;
+                f->tile_id = gpu->vram[map + (fifo_map_y(gpu) >> 3) * 32 + (mx & 0x1F)];
+                f->fetch = FIFO_FETCH_LO;
+                break;
+            }
+            case FIFO_FETCH_LO:
+                f->lo = gpu->vram[fifo_tile_addr(gpu)];
+                f->fetch = FIFO_FETCH_HI;
+                break;
+            case FIFO_FETCH_HI:
+                f->hi = gpu->vram[fifo_tile_addr(gpu) + 1];
+                f->fetch = FIFO_FETCH_PUSH;
+                break;
+            case FIFO_FETCH_PUSH:
+                break;
+        }
+    }
+
+    if(f->fetch == FIFO_FETCH_PUSH && f->bg_len == 0) {
+        if(f->dummy) {
+            f->dummy = 0;
+        } else {
+            for(int i = 0; i < 8; i++) {
+                f->bg[i] = (uint8_t)(((f->lo >> (7 - i)) & 1) | (((f->hi >> (7 - i)) & 1) << 1));
+            }
+            f->bg_head = 0;
+            f->bg_len = 8;
+            f->fetch_x++;
+        }
+        f->fetch = FIFO_FETCH_TILE;
+    }
+}
+
+/* Mix a fetched object into the object FIFO. Pixels already taken keep priority. */
+static void fifo_fetch_obj(struct gpu *gpu, const struct obj *obj) {
+    struct fifo *f = &gpu->fifo;
+    int h = (gpu->reg_lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+    int py = gpu->reg_ly - (obj->y - 16);
+    if(obj->attr & OBJ_ATTR_VFLIP) {
+        py = h - 1 - py;
+    }
+
+    /* 8x16 objects ignore bit 0 of the tile id. */
+    int tile = (h == 16) ? ((obj->tile_id & 0xFE) + (py >> 3)) : obj->tile_id;
+    const uint8_t *row = gpu->tiles[(obj->attr & OBJ_ATTR_HFLIP) != 0][tile][py & 0x07];
+    uint8_t pal = (obj->attr & OBJ_ATTR_PALETTE) ? GPU_PAL_OBP1 : GPU_PAL_OBP0;
+
+    for(int px = 0; px < 8; px++) {
+        int slot = obj->x - 8 + px - f->x;
+        if(slot < 0 || slot >= 8 || row[px] == 0 || f->obj[slot] != 0) {
+            continue;
+        }
+        f->obj[slot] = pal + row[px];
+        f->obj_prio[slot] = obj->attr & OBJ_ATTR_PRIORITY;
+    }
+}
+
+/* Mode 3: fetch and shift out at most one pixel. */
+static void fifo_mode3(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+
+    /*
+     *  An object starting at this pixel stalls the FIFOs for 6 dots, plus
+     *  up to 5 more for the first object over a background tile.
+     */
+    if(f->obj_stall == 0 && (gpu->reg_lcdc & LCDC_OBJ_ON) && f->obj_next < f->obj_count &&
+            fifo_obj(gpu, f->obj_next)->x <= f->x + 8) {
+        int x = fifo_obj(gpu, f->obj_next)->x + gpu->reg_scx;
+        f->obj_stall = 6;
+        if((x >> 3) != f->obj_tile) {
+            f->obj_stall += 5 - ((x & 0x07) < 5 ? (x & 0x07) : 5);
+            f->obj_tile = x >> 3;
+        }
+    }
+    if(f->obj_stall > 0) {
+        if(--f->obj_stall == 0) {
+            fifo_fetch_obj(gpu, fifo_obj(gpu, f->obj_next));
+            f->obj_next++;
+        }
+        return;
+    }
+
+    /* Starting the window restarts the fetcher. */
+    uint8_t lcdc = gpu->reg_lcdc;
+    if(!f->window && (lcdc & LCDC_WIN_ON) && (lcdc & LCDC_BG_ON) && f->wy_hit && gpu->reg_wx < SCREEN_WIDTH + 7 &&
+            f->x + 7 >= gpu->reg_wx) {
+        f->window = 1;
+        f->window_drawn = 1;
+        f->bg_len = 0;
+        f->fetch = FIFO_FETCH_TILE;
+        f->fetch_dots = 0;
+        f->fetch_x = 0;
+        f->dummy = 0;
+        f->discard = (gpu->reg_wx < 7) ? 7 - gpu->reg_wx : 0;
+    }
+
+    fifo_fetch_bg(gpu);
+    if(f->bg_len == 0) {
+        return;
+    }
+
+    uint8_t c = f->bg[f->bg_head++];
+    f->bg_len--;
+    if(f->discard > 0) {
+        f->discard--;
+        return;
+    }
+
+    uint8_t o = f->obj[0];
+    uint8_t prio = f->obj_prio[0];
+    memmove(f->obj, &f->obj[1], 7);
+    memmove(f->obj_prio, &f->obj_prio[1], 7);
+    f->obj[7] = 0;
+    f->obj_prio[7] = 0;
+
+    /* Objects with priority are behind background colors 1-3. */
+    uint8_t pixel = (lcdc & LCDC_BG_ON) ? GPU_PAL_BG + c : GPU_PAL_BLANK;
+    if(o != 0 && (lcdc & LCDC_OBJ_ON) && !(prio && (lcdc & LCDC_BG_ON) && c != 0)) {
+        pixel = o;
+    }
+
+    if(!gpu->skipping) {
+        gpu->lines[gpu->reg_ly][f->x] = pixel;
+        pixel_put(gpu->frame, gpu->reg_ly * SCREEN_WIDTH + f->x, gpu->colors[gpu->shades[pixel]]);
+    }
+
+    if(++f->x == SCREEN_WIDTH) {
+        gpu->mode = GPU_MODE_HBLANK;
+        if(!gpu->skipping) {
+            memcpy(gpu->line_shades[gpu->reg_ly], gpu->shades, sizeof(gpu->shades));
+            gpu->frame_gen++;
+        }
+    }
+}
+
+/* Update STAT and interrupt on the rising edge of the STAT interrupt line. */
+static void fifo_stat(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+    uint8_t stat = gpu->reg_stat & ~(STAT_MATCH | STAT_MODE);
+
+    if(gpu->reg_ly == gpu->reg_lyc) {
+        stat |= STAT_MATCH;
+    }
+    stat |= gpu->mode;
+    gpu->reg_stat = stat;
+
+    /* The OAM interrupt also fires when VBLANK starts. */
+    int line = ((stat & STAT_MATCH) && (stat & STAT_INT_MATCH)) ||
+        (gpu->mode == GPU_MODE_HBLANK && (stat & STAT_INT_HBLANK)) ||
+        (gpu->mode == GPU_MODE_VBLANK && (stat & STAT_INT_VBLANK)) ||
+        (gpu->mode == GPU_MODE_OAM && (stat & STAT_INT_OAM)) ||
+        (gpu->reg_ly == 144 && f->dot == 0 && (stat & STAT_INT_OAM));
+
+    if(line && !f->stat_line) {
+        interrupt_controller_trigger(gpu->ic, INT_LCDC);
+    }
+    f->stat_line = line;
+}
+
+static void fifo_next_line(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+
+    /* The window line counter only advances on lines where it was drawn. */
+    if(f->window_drawn) {
+        gpu->win_line++;
+        f->window_drawn = 0;
+    }
+
+    gpu->reg_ly++;
+    if(gpu->reg_ly == 144) {
+        gpu->mode = GPU_MODE_VBLANK;
+        gpu->frame_done = 1;
+        interrupt_controller_trigger(gpu->ic, INT_VBLANK);
+    } else if(gpu->reg_ly == 154) {
+        gpu->reg_ly = 0;
+        gpu->win_line = 0;
+        f->wy_hit = 0;
+    }
+}
+
+static void fifo_dot(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+
+    if(gpu->reg_ly < 144) {
+        if(f->dot == 0) {
+            gpu->mode = GPU_MODE_OAM;
+            if(gpu->reg_ly == gpu->reg_wy) {
+                f->wy_hit = 1;
+            }
+            fifo_select_objects(gpu);
+        } else if(f->dot == DOTS_OAM) {
+            gpu->mode = GPU_MODE_RAM;
+            fifo_start_line(gpu);
+        }
+
+        if(gpu->mode == GPU_MODE_RAM) {
+            fifo_mode3(gpu);
+        }
+    }
+
+    fifo_stat(gpu);
+
+    if(++f->dot == DOTS_LINE) {
+        f->dot = 0;
+        fifo_next_line(gpu);
+    }
+}
+
+/*** Public ***/
+
+/* Pick up from the scanline engine's mode and clock. */
+void fifo_reset(struct gpu *gpu) {
+    struct fifo *f = &gpu->fifo;
+    memset(f, 0, sizeof(struct fifo));
+
+    f->wy_hit = gpu->reg_wy <= gpu->reg_ly;
+    switch(gpu->mode) {
+        case GPU_MODE_OAM:
+            f->dot = gpu->clock;
+            fifo_select_objects(gpu);
+            break;
+        case GPU_MODE_RAM:
+            f->dot = DOTS_OAM + gpu->clock;
+            fifo_select_objects(gpu);
+            fifo_start_line(gpu);
+            break;
+        case GPU_MODE_HBLANK:
+            f->dot = DOTS_LINE - 204 + gpu->clock;
+            f->x = SCREEN_WIDTH;
+            break;
+        case GPU_MODE_VBLANK:
+            f->dot = gpu->clock;
+            break;
+    }
+}
+
+void fifo_update(struct gpu *gpu, int cycles) {
+    struct fifo *f = &gpu->fifo;
+
+    /* Check that LCD is turned on. */
+    if((gpu->reg_lcdc & LCDC_ON) == 0) {
+        f->dot = 0;
+        f->wy_hit = 0;
+        f->window_drawn = 0;
+        f->stat_line = 0;
+        gpu->mode = GPU_MODE_HBLANK;
+        gpu->reg_ly = 0;
+        gpu->win_line = 0;
+        gpu->reg_stat &= ~STAT_MODE;
+        return;
+    }
+
+    while(cycles-- > 0) {
+        fifo_dot(gpu);
+    }
+}
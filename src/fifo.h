@@ -0,0 +1,77 @@
+/*
+ *  fifo.h
+ *  ======
+ *
+ *  Cycle accurate GPU engine, modelled on the hardware background fetcher
+ *  and pixel FIFOs. It is stepped one dot (4 MHz cycle) at a time:
+ *
+ *      mode 2  - 80 dots, the (up to 10) objects on the line are selected.
+ *      mode 3  - 172 dots and more. The fetcher reads the tile map and tile
+ *                data two dots per step and refills the background FIFO
+ *                when it runs empty; one pixel is shifted out per dot.
+ *                SCX % 8 pixels are dropped at the start of the line,
+ *                starting the window restarts the fetcher (6 dots) and each
+ *                object stalls output for 6 - 11 dots.
+ *      mode 0  - the rest of the 456 dot line.
+ *
+ *  Registers written in the middle of a line take effect from the next
+ *  pixel, and STAT interrupts fire on the rising edge of the combined STAT
+ *  interrupt line.
+ *
+ *  The engine is much slower than the scanline renderer in gpu.c and is
+ *  meant for validation, see gpu_set_engine().
+ *
+ */
+#ifndef GBOY_FIFO_H
+#define GBOY_FIFO_H
+
+#include <inttypes.h>
+
+struct gpu;
+
+enum fifo_fetch {
+    FIFO_FETCH_TILE,
+    FIFO_FETCH_LO,
+    FIFO_FETCH_HI,
+    FIFO_FETCH_PUSH,
+};
+
+struct fifo {
+    int dot;                /* Dot in the current line, 0 - 455. */
+    int x;                  /* Next pixel to output. */
+    int discard;            /* Pixels left to drop (SCX % 8, WX < 7). */
+    int stat_line;          /* STAT interrupt line. */
+    int wy_hit;             /* LY has matched WY this frame. */
+    int window;             /* Fetching the window. */
+    int window_drawn;       /* The window was started on this line. */
+
+    /* Background FIFO, color indices 0-3. */
+    uint8_t bg[8];
+    int bg_head;
+    int bg_len;
+
+    /* Object FIFO, palette qualified color indices (0 for transparent). */
+    uint8_t obj[8];
+    uint8_t obj_prio[8];
+
+    /* Background fetcher. */
+    enum fifo_fetch fetch;
+    int fetch_dots;         /* Dots spent in the current step. */
+    int fetch_x;            /* Tile column. */
+    int dummy;              /* The first fetch of a line is thrown away. */
+    uint8_t tile_id;
+    uint8_t lo;
+    uint8_t hi;
+
+    /* Objects on the line (OAM indices) in X order. */
+    uint8_t objs[10];
+    int obj_count;
+    int obj_next;           /* Next object to fetch. */
+    int obj_stall;          /* Dots left of the current object fetch. */
+    int obj_tile;           /* Background tile of the last object fetched. */
+};
+
+void fifo_reset(struct gpu *gpu);
+void fifo_update(struct gpu *gpu, int cycles);
+
+#endif
@@ -0,0 +1,261 @@
+#include <string.h>
+#include "filter.h"
+#include "screen.h"
+
+/* 4 pixels, and the same as bytes (channels). */
+typedef uint32_t vpix __attribute__((vector_size(16)));
+typedef int32_t vint __attribute__((vector_size(16)));
+typedef uint8_t vbyte __attribute__((vector_size(16)));
+
+/* Channels further apart than this are different colors (hq2x, xbr). */
+#define FILTER_THRESHOLD    48
+
+/*** Private ***/
+
+static inline vpix load(const uint32_t *p) {
+    vpix v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store(uint32_t *p, const vpix v) {
+    memcpy(p, &v, sizeof(v));
+}
+
+/* Where mask is set a, else b. */
+static inline vpix pick(const vpix mask, const vpix a, const vpix b) {
+    return (mask & a) | (~mask & b);
+}
+
+static inline vpix eq(const vpix a, const vpix b) {
+    return (vpix)(a == b);
+}
+
+/* Per channel average, rounded up. */
+static inline vpix avg(const vpix a, const vpix b) {
+    vbyte x = (vbyte)a;
+    vbyte y = (vbyte)b;
+    return (vpix)((x | y) - ((x ^ y) >> 1));
+}
+
+/* All channels within FILTER_THRESHOLD. */
+static inline vpix sim(const vpix a, const vpix b) {
+    vbyte x = (vbyte)a;
+    vbyte y = (vbyte)b;
+    vbyte gt = (vbyte)(x > y);
+    vbyte d = (gt & (x - y)) | (~gt & (y - x));
+    vbyte far = (vbyte)(d > FILTER_THRESHOLD);
+    return eq((vpix)far, (vpix){ 0, 0, 0, 0 });
+}
+
+/* Interleave 2 or 3 vectors of pixels into one output line. */
+static inline void store2(uint32_t *out, const vpix a, const vpix b) {
+    store(&out[0], __builtin_shufflevector(a, b, 0, 4, 1, 5));
+    store(&out[4], __builtin_shufflevector(a, b, 2, 6, 3, 7));
+}
+
+static inline void interleave3(vpix *out, const vpix a, const vpix b, const vpix c) {
+    vpix ab0 = __builtin_shufflevector(a, b, 0, 4, 1, 5);
+    vpix ab1 = __builtin_shufflevector(a, b, 5, 2, 6, 6);
+    vpix ab2 = __builtin_shufflevector(a, b, 3, 7, 3, 7);
+    out[0] = __builtin_shufflevector(ab0, c, 0, 1, 4, 2);
+    out[1] = __builtin_shufflevector(ab1, c, 0, 5, 1, 2);
+    out[2] = __builtin_shufflevector(ab2, c, 6, 0, 1, 7);
+}
+
+static inline void store3(uint32_t *out, const vpix a, const vpix b, const vpix c) {
+    vpix v[3];
+    interleave3(v, a, b, c);
+    store(&out[0], v[0]);
+    store(&out[4], v[1]);
+    store(&out[8], v[2]);
+}
+
+/*
+ *  The 3x3 neighbourhood of E:
+ *
+ *      A B C
+ *      D E F
+ *      G H I
+ */
+#define FILTER_LOAD_3X3(in, s) \
+    vpix a = load(&(in)[-(s) - 1]), b = load(&(in)[-(s)]), c = load(&(in)[-(s) + 1]); \
+    vpix d = load(&(in)[-1]), e = load(&(in)[0]), f = load(&(in)[1]); \
+    vpix g = load(&(in)[(s) - 1]), h = load(&(in)[(s)]), i = load(&(in)[(s) + 1])
+
+static void filter_none(uint32_t *out, const uint32_t *in, int stride) {
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        memcpy(&out[y * SCREEN_WIDTH], &in[y * stride], SCREEN_WIDTH * sizeof(uint32_t));
+    }
+}
+
+static void filter_scale2x(uint32_t *out, const uint32_t *in, int stride) {
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        uint32_t *o = &out[y * 2 * SCREEN_WIDTH * 2];
+        for(int x = 0; x < SCREEN_WIDTH; x += 4) {
+            FILTER_LOAD_3X3(&in[y * stride + x], stride);
+            (void)a; (void)c; (void)g; (void)i;
+
+            vpix bd = eq(b, d), bf = eq(b, f), dh = eq(d, h), fh = eq(f, h);
+            vpix e0 = pick(bd & ~bf & ~dh, d, e);
+            vpix e1 = pick(bf & ~bd & ~fh, f, e);
+            vpix e2 = pick(dh & ~bd & ~fh, d, e);
+            vpix e3 = pick(fh & ~dh & ~bf, f, e);
+            store2(&o[x * 2], e0, e1);
+            store2(&o[SCREEN_WIDTH * 2 + x * 2], e2, e3);
+        }
+    }
+}
+
+static void filter_scale3x(uint32_t *out, const uint32_t *in, int stride) {
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        uint32_t *o = &out[y * 3 * SCREEN_WIDTH * 3];
+        for(int x = 0; x < SCREEN_WIDTH; x += 4) {
+            FILTER_LOAD_3X3(&in[y * stride + x], stride);
+
+            vpix bd = eq(b, d), bf = eq(b, f), dh = eq(d, h), fh = eq(f, h);
+            vpix tl = bd & ~bf & ~dh;   /* Edge through the top left corner. */
+            vpix tr = bf & ~bd & ~fh;
+            vpix bl = dh & ~bd & ~fh;
+            vpix br = fh & ~dh & ~bf;
+
+            vpix e0 = pick(tl, d, e);
+            vpix e1 = pick((tl & ~eq(e, c)) | (tr & ~eq(e, a)), b, e);
+            vpix e2 = pick(tr, f, e);
+            vpix e3 = pick((tl & ~eq(e, g)) | (bl & ~eq(e, a)), d, e);
+            vpix e5 = pick((tr & ~eq(e, i)) | (br & ~eq(e, c)), f, e);
+            vpix e6 = pick(bl, d, e);
+            vpix e7 = pick((bl & ~eq(e, i)) | (br & ~eq(e, g)), h, e);
+            vpix e8 = pick(br, f, e);
+            store3(&o[x * 3], e0, e1, e2);
+            store3(&o[SCREEN_WIDTH * 3 + x * 3], e3, e, e5);
+            store3(&o[SCREEN_WIDTH * 6 + x * 3], e6, e7, e8);
+        }
+    }
+}
+
+/* One hq2x corner of e, between edge neighbours p and q and the diagonal r. */
+static inline vpix hq2x_corner(const vpix e, const vpix p, const vpix q, const vpix r) {
+    vpix sp = sim(e, p), sq = sim(e, q);
+    vpix edge = sim(p, q) & ~sp & ~sq;
+    vpix lone = sp & sq & ~sim(e, r);
+    return pick(edge, avg(e, avg(p, q)), pick(lone, avg(e, avg(e, r)), e));
+}
+
+static void filter_hq2x(uint32_t *out, const uint32_t *in, int stride) {
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        uint32_t *o = &out[y * 2 * SCREEN_WIDTH * 2];
+        for(int x = 0; x < SCREEN_WIDTH; x += 4) {
+            FILTER_LOAD_3X3(&in[y * stride + x], stride);
+            store2(&o[x * 2], hq2x_corner(e, b, d, a), hq2x_corner(e, b, f, c));
+            store2(&o[SCREEN_WIDTH * 2 + x * 2], hq2x_corner(e, h, d, g), hq2x_corner(e, h, f, i));
+        }
+    }
+}
+
+/* 1 where the pixels differ. */
+static inline vint xbr_d(const vpix a, const vpix b) {
+    return (vint)~sim(a, b) & 1;
+}
+
+/*
+ *  The bottom right xBR corner of e, with the 5x5 neighbourhood mirrored
+ *  so the corner is at the bottom right:
+ *
+ *            b1 c1
+ *         a  b  c  c4
+ *      d0 d  e  f  f4
+ *         g  h  i  i4
+ *            h5 i5
+ *
+ *  Edges along f-h win when pixels differ less in that direction than
+ *  across it.
+ */
+static inline vpix xbr_corner(const vpix e, const vpix f, const vpix h, const vpix i, const vpix c,
+        const vpix g, const vpix f4, const vpix h5, const vpix i4, const vpix i5, const vpix d,
+        const vpix b) {
+    vint along = xbr_d(e, c) + xbr_d(e, g) + xbr_d(i, f4) + xbr_d(i, h5) + 4 * xbr_d(h, f);
+    vint across = xbr_d(h, d) + xbr_d(h, i5) + xbr_d(f, i4) + xbr_d(f, b) + 4 * xbr_d(e, i);
+    vpix edge = (vpix)(along < across) & ~sim(e, f) & ~sim(e, h);
+    vpix near = pick((vpix)(xbr_d(e, f) <= xbr_d(e, h)), f, h);
+    return pick(edge, avg(e, near), e);
+}
+
+static void filter_xbr(uint32_t *out, const uint32_t *in, int stride) {
+    const int s = stride;
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        uint32_t *o = &out[y * 2 * SCREEN_WIDTH * 2];
+        for(int x = 0; x < SCREEN_WIDTH; x += 4) {
+            const uint32_t *p = &in[y * stride + x];
+            FILTER_LOAD_3X3(p, s);
+            vpix a1 = load(&p[-2 * s - 1]), b1 = load(&p[-2 * s]), c1 = load(&p[-2 * s + 1]);
+            vpix a0 = load(&p[-s - 2]), c4 = load(&p[-s + 2]);
+            vpix d0 = load(&p[-2]), f4 = load(&p[2]);
+            vpix g0 = load(&p[s - 2]), i4 = load(&p[s + 2]);
+            vpix g5 = load(&p[2 * s - 1]), h5 = load(&p[2 * s]), i5 = load(&p[2 * s + 1]);
+
+            vpix tl = xbr_corner(e, d, b, a, g, c, d0, b1, a0, a1, f, h);
+            vpix tr = xbr_corner(e, f, b, c, i, a, f4, b1, c4, c1, d, h);
+            vpix bl = xbr_corner(e, d, h, g, a, i, d0, h5, g0, g5, f, b);
+            vpix br = xbr_corner(e, f, h, i, c, g, f4, h5, i4, i5, d, b);
+            store2(&o[x * 2], tl, tr);
+            store2(&o[SCREEN_WIDTH * 2 + x * 2], bl, br);
+        }
+    }
+}
+
+/*
+ *  Each pixel becomes 3x3 with the right column and bottom row at 3/4
+ *  brightness, then 3/4 of the new frame is mixed with 1/4 of the last.
+ */
+static void filter_lcd(uint32_t *out, const uint32_t *in, int stride) {
+    const vpix black = { 0xFF000000, 0xFF000000, 0xFF000000, 0xFF000000 };
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        for(int x = 0; x < SCREEN_WIDTH; x += 4) {
+            vpix e = load(&in[y * stride + x]);
+            vpix grid = avg(e, avg(e, black));
+            for(int row = 0; row < 3; row++) {
+                uint32_t *o = &out[(y * 3 + row) * SCREEN_WIDTH * 3 + x * 3];
+                vpix v[3];
+                if(row == 2) {
+                    interleave3(v, grid, grid, grid);
+                } else {
+                    interleave3(v, e, e, grid);
+                }
+
+                /* The previous frame is still in the output. */
+                for(int k = 0; k < 3; k++) {
+                    store(&o[k * 4], avg(v[k], avg(v[k], load(&o[k * 4]))));
+                }
+            }
+        }
+    }
+}
+
+/*** Public ***/
+
+const struct filter FILTERS[] = {
+    { "none",       1, 0, filter_none },
+    { "scale2x",    2, 0, filter_scale2x },
+    { "scale3x",    3, 0, filter_scale3x },
+    { "hq2x",       2, 0, filter_hq2x },
+    { "xbr",        2, 0, filter_xbr },
+    { "lcd",        3, 4, filter_lcd },
+};
+
+const int FILTER_COUNT = sizeof(FILTERS) / sizeof(FILTERS[0]);
+
+const struct filter *filter_find(const char *name) {
+    for(int i = 0; i < FILTER_COUNT; i++) {
+        if(strcmp(FILTERS[i].name, name) == 0) {
+            return &FILTERS[i];
+        }
+    }
+    return NULL;
+}
+
+/* The filter after this one, wrapping around. */
+const struct filter *filter_next(const struct filter *filter) {
+    int i = (int)(filter - FILTERS) + 1;
+    return &FILTERS[i % FILTER_COUNT];
+}
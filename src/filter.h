@@ -0,0 +1,51 @@
+/*
+ *  filter.h
+ *  ========
+ *
+ *  Pixel art upscalers for the screen. All work on 0xAARRGGBB pixels,
+ *  4 at a time, using the compiler's portable vector types (SSE2 on x86,
+ *  NEON on ARM):
+ *
+ *      none    - 1x, the renderer scales with nearest neighbour.
+ *      scale2x - 2x, AdvanceMAME Scale2x (EPX).
+ *      scale3x - 3x, AdvanceMAME Scale3x.
+ *      hq2x    - 2x, reduced hq2x: each corner is blended with its
+ *                neighbours along an edge (or a lone differing corner
+ *                pixel), with colors compared by a per channel threshold
+ *                instead of the full YUV rule table.
+ *      xbr     - 2x, reduced xBR level 1: the edge direction at each
+ *                corner is decided by counting differing pixel pairs in
+ *                the 5x5 neighbourhood.
+ *      lcd     - 3x, LCD pixel grid with the slow response (ghosting) of
+ *                the original screen.
+ *
+ *  The input is a padded copy of the frame: FILTER_PAD pixels on each
+ *  side repeat the edge, so kernels never check bounds. Output lines are
+ *  scale * SCREEN_WIDTH pixels. The lcd filter blends with what is in
+ *  the output already, the previous frame. The difference to the input
+ *  shrinks to a quarter each run, so it is run again on an unchanged frame
+ *  for settle frames until the old one has faded out.
+ *
+ */
+#ifndef GBOY_FILTER_H
+#define GBOY_FILTER_H
+
+#include <inttypes.h>
+
+#define FILTER_PAD          2
+#define FILTER_SCALE_MAX    3
+
+struct filter {
+    const char *name;
+    int scale;
+    int settle;             /* Runs until the output has caught up with an unchanged input. */
+    void (*run)(uint32_t *out, const uint32_t *in, int stride);
+};
+
+extern const struct filter FILTERS[];
+extern const int FILTER_COUNT;
+
+const struct filter *filter_find(const char *name);
+const struct filter *filter_next(const struct filter *filter);
+
+#endif
@@ -1,27 +1,23 @@
 #include <stdlib.h>
 #include <SDL2/SDL.h>
-#include <time.h>
 #include "gboy.h"
 #include "cartridge.h"
 
 /* TODO: move a lot of this into cpu. */
 
-/*
- *  Timing
- *  ======
- *
- *  60 FPS = 0.01667s/frame = 16.67 ms/frame
- *  Game Boy run at 4194304 Hz = ~69905 cycles/frame (t-cycles)
- *
- */
-
-const float CYCLES_PER_SEC      = 4194304.0;
-const float FRAMES_PER_SEC      = 60.0f;
-const float MS_PER_FRAME        = (1000.0f / (float)FRAMES_PER_SEC);
-const float CYCLES_PER_FRAME    = (CYCLES_PER_SEC / FRAMES_PER_SEC);
-
 /*** Private ***/
 
+/* The save file is the ROM path with its extension replaced by .sav. */
+static void gboy_save_path(char *buf, const size_t size, const char *path) {
+    snprintf(buf, size, "%s", path);
+    char *dot = strrchr(buf, '.');
+    char *slash = strrchr(buf, '/');
+    if(dot == NULL || (slash != NULL && dot < slash)) {
+        dot = buf + strlen(buf);
+    }
+    snprintf(dot, size - (size_t)(dot - buf), ".sav");
+}
+
 static void gboy_handle_sdl_events(struct gboy *gb) {
     SDL_Event evt;
     while(SDL_PollEvent(&evt)) {
@@ -29,6 +25,11 @@ static void gboy_handle_sdl_events(struct gboy *gb) {
             case SDL_QUIT:
                 gb->cpu.running = 0;
                 break;
+            case SDL_WINDOWEVENT:
+                if(evt.window.event == SDL_WINDOWEVENT_SIZE_CHANGED) {
+                    screen_redraw(&gb->screen);
+                }
+                break;
             case SDL_KEYDOWN:
                 switch(evt.key.keysym.sym) {
                     case SDLK_ESCAPE:
@@ -41,6 +42,9 @@ static void gboy_handle_sdl_events(struct gboy *gb) {
                     case SDLK_p:
                         cpu_debug(&gb->cpu);
                         break;
+                    case SDLK_f:
+                        screen_set_filter(&gb->screen, filter_next(gb->screen.filter));
+                        break;
                     case SDLK_RIGHT: input_keydown(&gb->input, KEY_RIGHT); break;
                     case SDLK_LEFT: input_keydown(&gb->input, KEY_LEFT); break;
                     case SDLK_UP: input_keydown(&gb->input, KEY_UP); break;
@@ -85,7 +89,8 @@ int gboy_init(struct gboy *gb) {
     gpu_init(&gb->gpu, &gb->ic, &gb->screen);
     timer_init(&gb->timer, &gb->ic);
     input_init(&gb->input);
-    apu_init(&gb->apu);
+    apu_init(&gb->apu, &gb->capture);
+    pace_init(&gb->pace, &gb->apu);
 
     /* Skip boot. */
     if(1) {
@@ -103,6 +108,13 @@ int gboy_init(struct gboy *gb) {
         gpu_io_set_obp1(&gb->gpu, 0xFF);
 
         mmu_wb(&gb->mmu, 0xFF02, 0x7E);
+
+        /* Sound on, as the boot ROM leaves it after its chime. */
+        mmu_wb(&gb->mmu, 0xFF26, 0x80);
+        mmu_wb(&gb->mmu, 0xFF24, 0x77);
+        mmu_wb(&gb->mmu, 0xFF25, 0xF3);
+        mmu_wb(&gb->mmu, 0xFF11, 0x80);
+        mmu_wb(&gb->mmu, 0xFF12, 0xF3);
     }
 
     return 0;
@@ -117,6 +129,7 @@ void gboy_cleanup(struct gboy *gb) {
     timer_cleanup(&gb->timer);
     input_cleanup(&gb->input);
     apu_cleanup(&gb->apu);
+    capture_stop(&gb->capture);
     SDL_Quit();
 }
 
@@ -128,17 +141,29 @@ void gboy_run(struct gboy *gb, const char *path) {
         return;
     }
 
-    mmu_load_rom(&gb->mmu, path);
+    if(mmu_load_cartridge(&gb->mmu, &cartridge) != 0) {
+        fprintf(stderr, "failed to load cartridge: %s\n", path);
+        cartridge_cleanup(&cartridge);
+        return;
+    }
+
+    char save_path[1024];
+    gboy_save_path(save_path, sizeof(save_path), path);
+    mbc_load_save(&gb->mmu.mbc, save_path);
 
-    uint32_t time = SDL_GetTicks();
     uint16_t cycles = 0;
-    uint64_t total_cycles = 0;
+    uint32_t frame_cycles = 0;
+    uint32_t frames = 0;
+    uint32_t every = (uint32_t)(gb->frame_skip + 1);
+    int presented = 0;
 
     gb->cpu.running = 1;
+    pace_reset(&gb->pace);
+    gpu_skip_frame(&gb->gpu, 1 % every != 0);
 
     while(gb->cpu.running) {
         cycles = cpu_step(&gb->cpu);
-        total_cycles += cycles;
+        frame_cycles += cycles;
 
         interrupt_controller_handle(&gb->ic);
         timer_update(&gb->timer, cycles);
@@ -154,19 +179,52 @@ void gboy_run(struct gboy *gb, const char *path) {
             }
         }
 
-        /* Update screen if a frame has passed. */
-        if(total_cycles > CYCLES_PER_FRAME) {
-            total_cycles %= (int)CYCLES_PER_FRAME;
-            screen_update(&gb->screen);
-            gboy_handle_sdl_events(gb);
+        /*
+         *  Frames are shown when the GPU completes them, only drawing the
+         *  ones that will be shown. While the LCD is off there are none,
+         *  a frame's worth of cycles stands in for one. Pacing always
+         *  goes by the cycles.
+         */
+        int tick = frame_cycles >= PACE_CYCLES_PER_FRAME;
+        if(tick) {
+            frame_cycles -= PACE_CYCLES_PER_FRAME;
+        }
+        int done = gpu_frame_done(&gb->gpu);
+        if(done && !gb->gpu.skipping && gb->frame_hook != NULL) {
+            gb->frame_hook(gb, gb->frame_hook_user);
+        }
+        if(done || (tick && (gb->gpu.reg_lcdc & LCDC_ON) == 0)) {
+            frames++;
+            gpu_skip_frame(&gb->gpu, (frames + 1) % every != 0);
+            if(frames % every == 0) {
+                gpu_present(&gb->gpu);
+                capture_frame(&gb->capture, &gb->gpu);
+                if(gpu_frame_changed(&gb->gpu, &gb->screen_watch)) {
+                    presented |= screen_update(&gb->screen);
+                } else {
+                    presented |= screen_settle(&gb->screen);
+                }
+            }
+        }
 
-            time = SDL_GetTicks() - time;
-            if(time < MS_PER_FRAME) {
-                SDL_Delay((uint32_t)(MS_PER_FRAME - time));
+        if(tick) {
+            /*
+             *  With vsync presenting is the wait, so present once per
+             *  frame: a finished filtered frame waits for the next one.
+             */
+            if(gb->pace.clock != PACE_VSYNC) {
+                screen_poll(&gb->screen);
+            } else if(!presented && !screen_poll(&gb->screen)) {
+                screen_redraw(&gb->screen);
             }
-            time = SDL_GetTicks();
+            presented = 0;
+            gboy_handle_sdl_events(gb);
+            pace_frame(&gb->pace);
         }
     }
 
+    mbc_save(&gb->mmu.mbc, save_path);
+    cartridge_cleanup(&cartridge);
+
     // getchar();
 }
@@ -21,17 +21,27 @@
 #include "timer.h"
 #include "input.h"
 #include "apu.h"
+#include "pace.h"
+#include "capture.h"
 
 struct gboy {
     int                         debug;
+    int                         frame_skip;     /* Frames skipped after each drawn one. */
     struct cpu                  cpu;
     struct interrupt_controller ic;
     struct mmu                  mmu;
     struct gpu                  gpu;
     struct screen               screen;
+    struct gpu_frame_watch      screen_watch;   /* Last frame shown on screen. */
     struct timer                timer;
     struct input                input;
     struct apu                  apu;
+    struct pace                 pace;
+    struct capture              capture;
+
+    /* Called with each drawn frame at VBLANK, e.g. for observe_frame(). */
+    void                        (*frame_hook)(struct gboy *gb, void *user);
+    void                        *frame_hook_user;
 };
 
 int     gboy_init(struct gboy *gboy);
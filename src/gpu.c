@@ -2,9 +2,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <SDL2/SDL.h>
 #include "gpu.h"
 #include "interrupt.h"
-#include "bitutil.h"
 #include "screen.h"
 
 #define CYCLES_HBLANK   204
@@ -13,6 +13,15 @@
 #define CYCLES_RAM      172
 #define CYCLES_LINE     456     /* OAM+RAM+HBLANK */
 
+/*
+ *  Render log entries are writes (addr, value) in the memory map, or one of
+ *  the markers below (ROM addresses are never logged).
+ */
+#define GPU_LOG_LINE    0x0000  /* Render line value. */
+#define GPU_LOG_FRAME   0x0001  /* Frame done, swap buffers. */
+#define GPU_LOG_QUIT    0x0002  /* Stop the worker. */
+#define GPU_LOG_SIZE    0x4000  /* Entries per log. */
+
 /*** Private ***/
 
 static uint8_t get_color(uint8_t data, uint8_t palette) {
@@ -25,148 +34,497 @@ static uint8_t get_color(uint8_t data, uint8_t palette) {
     return 0;
 }
 
-static uint8_t get_color_value(uint8_t color) {
-    switch(color) {
-        case 0: return 0xFF;
-        case 1: return 0xC0;
-        case 2: return 0x60;
-        case 3: return 0x00;
+/* Map each of the 4 color indices through a palette register. */
+static void gpu_build_palette(uint8_t *shades, uint8_t palette) {
+    for(uint8_t i = 0; i < 4; i++) {
+        shades[i] = get_color(i, palette);
+    }
+}
+
+/* Decode the tile row containing VRAM address addr into the tile cache. */
+static void gpu_decode_tile_row(struct gpu *gpu, const uint16_t addr) {
+    int tile = addr >> 4;
+    int row = (addr >> 1) & 0x07;
+    gpu->kernels->decode(gpu->tiles[0][tile][row], gpu->tiles[1][tile][row], &gpu->vram[addr & ~1], 1);
+}
+
+/*
+ *  Redraw the parts of a tile map bitmap whose map entries or tiles have
+ *  changed, or all of it if it was drawn with the other tile data area.
+ */
+static void gpu_update_map(struct gpu *gpu, const int m, const int signed_ids) {
+    int full = gpu->map_signed[m] != signed_ids;
+    if(!full && !gpu->map_dirty[m]) {
+        return;
+    }
+
+    const uint8_t *map = &gpu->vram[0x1800 + m * 0x400];
+    for(int cell = 0; cell < 1024; cell++) {
+        /* Signed ids are relative to tile 256 (0x9000). */
+        int tile = signed_ids ? 256 + (int8_t)map[cell] : map[cell];
+        if(!full && !gpu->map_cell_dirty[m][cell] && !gpu->map_tile_dirty[m][tile]) {
+            continue;
+        }
+
+        int x = (cell & 0x1F) * 8;
+        int y = (cell >> 5) * 8;
+        for(int row = 0; row < 8; row++) {
+            memcpy(&gpu->maps[m][y + row][x], gpu->tiles[0][tile][row], 8);
+        }
+    }
+
+    memset(gpu->map_cell_dirty[m], 0, sizeof(gpu->map_cell_dirty[m]));
+    memset(gpu->map_tile_dirty[m], 0, sizeof(gpu->map_tile_dirty[m]));
+    gpu->map_dirty[m] = 0;
+    gpu->map_signed[m] = (int8_t)signed_ids;
+}
+
+/* Copy count pixels of a map bitmap row starting at x, wrapping around at 256. */
+static void gpu_render_map_span(const struct gpu *gpu, uint8_t *out, const int m, const uint8_t x,
+        const uint8_t y, const int count) {
+    const uint8_t *row = gpu->maps[m][y];
+    int n = 256 - x;
+    if(n > count) {
+        n = count;
+    }
+    memcpy(out, &row[x], (size_t)n);
+    memcpy(&out[n], row, (size_t)(count - n));
+}
+
+/* Redraw all of both map bitmaps on next use. */
+static void gpu_invalidate_maps(struct gpu *gpu) {
+    gpu->map_signed[0] = gpu->map_signed[1] = -1;
+}
+
+/* Decode all of 0x8000 - 0x9800 into the tile cache. */
+static void gpu_decode_tiles(struct gpu *gpu) {
+    gpu->kernels->decode(gpu->tiles[0][0][0], gpu->tiles[1][0][0], gpu->vram, 384 * 8);
+}
+
+static int gpu_window_visible(const struct gpu_raster *r) {
+    return (r->lcdc & LCDC_WIN_ON) && r->wy <= r->ly && r->wx < SCREEN_WIDTH + 7;
+}
+
+/*
+ *  Capture the registers the current line is drawn with. The window has its
+ *  own line counter, which only advances on lines where it is drawn.
+ */
+static void gpu_capture(struct gpu *gpu, struct gpu_raster *r) {
+    r->ly = gpu->reg_ly;
+    r->lcdc = gpu->reg_lcdc;
+    r->scy = gpu->reg_scy;
+    r->scx = gpu->reg_scx;
+    r->wy = gpu->reg_wy;
+    r->wx = gpu->reg_wx;
+    r->bgp = gpu->reg_bgp;
+    r->obp0 = gpu->reg_obp0;
+    r->obp1 = gpu->reg_obp1;
+    r->win_line = gpu->win_line;
+
+    if((r->lcdc & LCDC_BG_ON) && gpu_window_visible(r)) {
+        gpu->win_line++;
     }
-    return 0xFF;
 }
 
-#define OBJ_ATTR_PRIORITY       0x80
-#define OBJ_ATTR_VFLIP          0x40
-#define OBJ_ATTR_HFLIP          0x20
-#define OBJ_ATTR_PALETTE        0x10
-#define OBJ_ATTR_BANK_CGB       0x08
-#define OBJ_ATTR_PALETTE_CGB    0x07
+/* Render the background, and the window over it from WX - 7 to the end of the line. */
+static void gpu_scanline_background(struct gpu *gpu, const struct gpu_raster *r, uint8_t *line) {
+    int signed_ids = (r->lcdc & LCDC_BG_DATA) == 0;
+    int win_x = SCREEN_WIDTH;
 
-struct obj {
-    uint8_t y;
-    uint8_t x;
-    uint8_t tile_id;
-    uint8_t attr;
-} __attribute__ ((packed));
+    if(gpu_window_visible(r)) {
+        win_x = (r->wx < 7) ? 0 : r->wx - 7;
+    }
 
-/* Make it a little easier to work with tile pixel data. */
-struct tile_data {
-    struct {
-        uint8_t lo;
-        uint8_t hi;
-    } __attribute__ ((packed)) rows[8];
-} __attribute__ ((packed));
+    int m = (r->lcdc & LCDC_BG_MAP) != 0;
+    gpu_update_map(gpu, m, signed_ids);
+    gpu_render_map_span(gpu, line, m, r->scx, r->ly + r->scy, win_x);
 
-/* Get the color for specific pixel in tile i in the data. */
-static uint8_t tile_data_pixel(const struct tile_data *data, const int i, const int y, const int x) {
-    /* Pixel rows are reversed. */
-    int rx = 7 - x;
-    return (uint8_t)(BIT_GET(data[i].rows[y].lo, rx) | BIT_GET(data[i].rows[y].hi, rx) << 1);
+    if(win_x < SCREEN_WIDTH) {
+        /* WX below 7 shifts the window left instead. */
+        int wx = (r->wx < 7) ? 7 - r->wx : 0;
+        m = (r->lcdc & LCDC_WIN_MAP) != 0;
+        gpu_update_map(gpu, m, signed_ids);
+        gpu_render_map_span(gpu, &line[win_x], m, (uint8_t)wx, r->win_line, SCREEN_WIDTH - win_x);
+    }
 }
 
-static void gpu_scanline_background(struct gpu *gpu) {
-    int win = 0;
-    int signed_ids = (gpu->reg_lcdc & LCDC_BG_DATA) == 0;
+/*
+ *  Bucket the objects by the lines they cover. Like the hardware, only the
+ *  first 10 objects (in OAM order) on a line are kept, and each line is
+ *  sorted by X and then OAM index, i.e. in drawing priority order.
+ */
+static void gpu_sort_objects(struct gpu *gpu, const int h) {
+    uint8_t old_count[SCREEN_HEIGHT];
+    memcpy(old_count, gpu->obj_count, sizeof(old_count));
+    memset(gpu->obj_count, 0, sizeof(gpu->obj_count));
+
+    for(uint8_t i = 0; i < 40; i++) {
+        const struct obj *obj = (const struct obj *)&gpu->oam[i * 4];
+        int y = obj->y - 16;
+
+        for(int ly = (y < 0) ? 0 : y; ly < y + h && ly < SCREEN_HEIGHT; ly++) {
+            uint8_t *objs = gpu->obj_lines[ly];
+            uint8_t n = gpu->obj_count[ly];
+            if(n == 10) {
+                continue;
+            }
+
+            /* Insert after all objects with the same or lower X. */
+            while(n > 0 && gpu->oam[objs[n - 1] * 4 + 1] > obj->x) {
+                objs[n] = objs[n - 1];
+                n--;
+            }
+            objs[n] = i;
+            gpu->obj_count[ly]++;
+        }
+    }
+
+    /* Lines whose objects changed get a new generation. */
+    for(int ly = 0; ly < SCREEN_HEIGHT; ly++) {
+        uint8_t data[40];
+        uint8_t n = gpu->obj_count[ly];
+        for(uint8_t i = 0; i < n; i++) {
+            memcpy(&data[i * 4], &gpu->oam[gpu->obj_lines[ly][i] * 4], 4);
+        }
 
-    if(gpu->reg_lcdc & LCDC_WIN_ON) {
-        win = gpu->reg_wy <= gpu->reg_ly;
+        if(n != old_count[ly] || memcmp(data, gpu->obj_data[ly], (size_t)n * 4) != 0) {
+            memcpy(gpu->obj_data[ly], data, (size_t)n * 4);
+            gpu->obj_gen[ly]++;
+        }
     }
 
-    if(win) {
-        printf("window not implemented!\n");
+    gpu->obj_height = (uint8_t)h;
+    gpu->oam_dirty = 0;
+}
+
+static void gpu_scanline_objects(const struct gpu *gpu, const struct gpu_raster *r, uint8_t *line) {
+    int h = gpu->obj_height;
+    uint8_t count = gpu->obj_count[r->ly];
+    if(count == 0) {
         return;
     }
 
-    uint8_t sy = gpu->reg_ly + gpu->reg_scy;
-    uint8_t *map_data = (gpu->reg_lcdc & LCDC_BG_MAP) ? &gpu->vram[0x1C00] : &gpu->vram[0x1800];
-    uint8_t *tile_data = (gpu->reg_lcdc & LCDC_BG_DATA) ? &gpu->vram[0x0000] : &gpu->vram[0x0800];
+    /* Pixels already taken by an object with higher priority. */
+    uint8_t taken[SCREEN_WIDTH];
+    memset(taken, 0, sizeof(taken));
+
+    for(uint8_t i = 0; i < count; i++) {
+        const struct obj *obj = (const struct obj *)&gpu->oam[gpu->obj_lines[r->ly][i] * 4];
+        int x = obj->x - 8;
+        int py = r->ly - (obj->y - 16);
+        if(obj->attr & OBJ_ATTR_VFLIP) {
+            py = h - 1 - py;
+        }
+
+        /* 8x16 objects ignore bit 0 of the tile id. */
+        int tile = (h == 16) ? ((obj->tile_id & 0xFE) + (py >> 3)) : obj->tile_id;
+        const uint8_t *row = gpu->tiles[(obj->attr & OBJ_ATTR_HFLIP) != 0][tile][py & 0x07];
+        uint8_t pal = (obj->attr & OBJ_ATTR_PALETTE) ? GPU_PAL_OBP1 : GPU_PAL_OBP0;
 
-    for(uint8_t i = 0; i < SCREEN_WIDTH; i++) {
-        uint8_t sx = i + gpu->reg_scx;
+        for(int px = 0; px < 8; px++) {
+            int sx = x + px;
 
-        /* Convert from screen y, x to map y, x. */
-        uint8_t my = sy / 8;
-        uint8_t mx = sx / 8;
+            /* Skip transparent, off-screen and already taken pixels. */
+            if(row[px] == 0 || sx < 0 || sx >= SCREEN_WIDTH || taken[sx]) {
+                continue;
+            }
+            taken[sx] = 1;
 
-        /* Get the tile id. */
-        uint8_t tile_id = map_data[(my * 32) + mx];
+            /* Behind background colors 1-3. */
+            if((obj->attr & OBJ_ATTR_PRIORITY) && line[sx] > GPU_PAL_BG && line[sx] < GPU_PAL_OBP0) {
+                continue;
+            }
 
-        if(signed_ids) {
-            tile_id = (uint8_t)((int8_t)(tile_id + 128));
+            line[sx] = pal + row[px];
         }
+    }
+}
 
-        /* And pixel y, x. */
-        uint8_t py = sy % 8;
-        uint8_t px = sx % 8;
+/*
+ *  Compose one line as palette qualified color indices. Returns 0, without
+ *  drawing anything, if the line has the same signature as when it was last
+ *  drawn: the frame still holds the right pixels.
+ */
+static int gpu_compose(struct gpu *gpu, const struct gpu_raster *r) {
+    uint8_t *line = gpu->lines[r->ly];
 
-        /* Use the tile id and pixel coordinates to get color for current point. */
-        uint8_t data = tile_data_pixel((struct tile_data *)tile_data, tile_id, py, px);
-        uint8_t color = get_color(data, gpu->reg_bgp);
+    int h = (r->lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
+    if((r->lcdc & LCDC_OBJ_ON) && (gpu->oam_dirty || gpu->obj_height != h)) {
+        gpu_sort_objects(gpu, h);
+    }
+
+    struct gpu_line_sig sig;
+    memset(&sig, 0, sizeof(sig));
+    sig.raster = *r;
+    sig.valid = 1;
+    sig.tile_gen = gpu->tile_gen;
+    sig.map_gen[0] = gpu->map_gen[0];
+    sig.map_gen[1] = gpu->map_gen[1];
+    sig.obj_gen = (r->lcdc & LCDC_OBJ_ON) ? gpu->obj_gen[r->ly] : 0;
+
+    if(memcmp(&sig, &gpu->line_sigs[r->ly], sizeof(sig)) == 0) {
+        return 0;
+    }
+    memcpy(&gpu->line_sigs[r->ly], &sig, sizeof(sig));
 
-        /* Convert color to screen color. */
-        uint8_t value = get_color_value(color);
+    if(r->lcdc & LCDC_BG_ON) {
+        gpu_scanline_background(gpu, r, line);
+    } else {
+        memset(line, GPU_PAL_BLANK, SCREEN_WIDTH);
+    }
 
-        /* And set it in the screen back buffer. */
-        int rgb_index = ((gpu->reg_ly * SCREEN_WIDTH) + i) * 4;
-        gpu->screen->back_buffer[rgb_index + 0] = value;
-        gpu->screen->back_buffer[rgb_index + 1] = value;
-        gpu->screen->back_buffer[rgb_index + 2] = value;
-        gpu->screen->back_buffer[rgb_index + 3] = 0xFF;
+    if(r->lcdc & LCDC_OBJ_ON) {
+        gpu_scanline_objects(gpu, r, line);
     }
+
+    return 1;
 }
 
-static void gpu_scanline_objects(struct gpu *gpu) {
-    /* TODO: sprite overlapping, priority */
-    struct obj *obj;
-    uint8_t h = (gpu->reg_lcdc & LCDC_OBJ_SIZE) ? 16 : 8;
-    for(int i = 0; i < 40; i++) {
-        obj = (struct obj *)&gpu->oam[i * 4];
-        uint8_t y = obj->y - 16;
-        uint8_t x = obj->x - 8;
+static void gpu_scanline(struct gpu *gpu) {
+    struct gpu_raster r;
+    gpu_capture(gpu, &r);
+    if(gpu_compose(gpu, &r)) {
+        gpu->kernels->map(&gpu->frame[PIXEL_OFFSET(r.ly * SCREEN_WIDTH)], gpu->lines[r.ly], gpu->shades, gpu->colors,
+            SCREEN_WIDTH);
+        memcpy(gpu->line_shades[r.ly], gpu->shades, sizeof(gpu->shades));
+        gpu->frame_gen++;
+    }
+}
 
-        if(gpu->reg_ly >= y && gpu->reg_ly < (y + h)) {
-            uint8_t py = gpu->reg_ly - y;
-            if(obj->attr & OBJ_ATTR_VFLIP) {
-                py = h - py;
-            }
+/*
+ *  Render the deferred lines. All lines are composed first, then runs of
+ *  changed lines drawn with the same palettes are mapped to pixels in one
+ *  call.
+ */
+static void gpu_flush(struct gpu *gpu) {
+    int from = gpu->raster_from;
+    int to = gpu->raster_to;
+    if(from == to) {
+        return;
+    }
+    gpu->raster_from = gpu->raster_to = 0;
 
-            for(uint8_t px = 0; px < 8; px++) {
-                uint8_t data;
-                if(obj->attr & OBJ_ATTR_HFLIP) {
-                    data = tile_data_pixel((struct tile_data *)&gpu->vram[0], obj->tile_id, py, 8 - px);
-                } else {
-                    data = tile_data_pixel((struct tile_data *)&gpu->vram[0], obj->tile_id, py, px);
-                }
+    uint8_t changed[SCREEN_HEIGHT];
+    for(int ly = from; ly < to; ly++) {
+        changed[ly] = (uint8_t)gpu_compose(gpu, &gpu->raster[ly]);
+    }
 
-                if(data == 0) {
-                    continue;
-                }
+    uint8_t shades[16];
+    memset(shades, 0, sizeof(shades));
 
-                uint8_t color = get_color(data, (obj->attr & OBJ_ATTR_PALETTE) ? gpu->reg_obp1 : gpu->reg_obp0);
+    while(from < to) {
+        if(!changed[from]) {
+            from++;
+            continue;
+        }
 
-                if(obj->attr & OBJ_ATTR_PRIORITY) {
-                    /* TODO: priority */
-                }
+        const struct gpu_raster *r = &gpu->raster[from];
+        int end = from + 1;
+        while(end < to && changed[end] && gpu->raster[end].bgp == r->bgp && gpu->raster[end].obp0 == r->obp0 &&
+                gpu->raster[end].obp1 == r->obp1) {
+            end++;
+        }
+
+        gpu_build_palette(&shades[GPU_PAL_BG], r->bgp);
+        gpu_build_palette(&shades[GPU_PAL_OBP0], r->obp0);
+        gpu_build_palette(&shades[GPU_PAL_OBP1], r->obp1);
+        gpu->kernels->map(&gpu->frame[PIXEL_OFFSET(from * SCREEN_WIDTH)], gpu->lines[from], shades, gpu->colors,
+            (end - from) * SCREEN_WIDTH);
+        for(int ly = from; ly < end; ly++) {
+            memcpy(gpu->line_shades[ly], shades, sizeof(shades));
+        }
+        gpu->frame_gen++;
+
+        from = end;
+    }
+}
+
+/* Log the current line, rendering what is pending first if it is out of order. */
+static void gpu_defer(struct gpu *gpu) {
+    if(gpu->reg_ly != gpu->raster_to) {
+        gpu_flush(gpu);
+        gpu->raster_from = gpu->raster_to = gpu->reg_ly;
+    }
+    gpu_capture(gpu, &gpu->raster[gpu->reg_ly]);
+    gpu->raster_to++;
+}
+
+struct gpu_log_entry {
+    uint16_t addr;
+    uint8_t value;
+};
+
+struct gpu_log {
+    struct gpu_log_entry entries[GPU_LOG_SIZE];
+    int count;
+};
+
+/*
+ *  Two logs are passed back and forth: the emulation thread fills one
+ *  while the worker replays the other. free counts logs the emulation
+ *  thread may take, ready counts logs waiting for the worker.
+ */
+struct gpu_worker {
+    SDL_Thread *thread;
+    SDL_sem *free;
+    SDL_sem *ready;
+    struct gpu_log logs[2];
+    int head;               /* Log being filled. */
+    int tail;               /* Log being replayed. */
+
+    struct gpu gpu;         /* The worker's copy of the GPU. */
+
+    SDL_mutex *lock;        /* Protects front and front_gen. */
+    pixel_t frames[2][PIXEL_OFFSET(SCREEN_WIDTH * SCREEN_HEIGHT)];
+    int front;              /* Last finished frame. */
+    uint32_t front_gen;     /* Its frame generation. */
+};
+
+/* Hand the current log to the worker and wait for the other one. */
+static void gpu_worker_submit(struct gpu_worker *worker) {
+    SDL_SemPost(worker->ready);
+    SDL_SemWait(worker->free);
+    worker->head ^= 1;
+    worker->logs[worker->head].count = 0;
+}
+
+static void gpu_log(struct gpu *gpu, const uint16_t addr, const uint8_t value) {
+    struct gpu_worker *worker = gpu->worker;
+    if(worker == NULL) {
+        return;
+    }
+
+    struct gpu_log *log = &worker->logs[worker->head];
+    log->entries[log->count].addr = addr;
+    log->entries[log->count].value = value;
+    if(++log->count == GPU_LOG_SIZE) {
+        gpu_worker_submit(worker);
+    }
+}
+
+/* Replay one log into the worker's GPU. Returns 1 when told to quit. */
+static int gpu_worker_replay(struct gpu_worker *worker, const struct gpu_log *log) {
+    struct gpu *gpu = &worker->gpu;
+
+    for(int i = 0; i < log->count; i++) {
+        uint16_t addr = log->entries[i].addr;
+        uint8_t v = log->entries[i].value;
 
-                uint8_t value = get_color_value(color);
-                int rgb_index = ((gpu->reg_ly * SCREEN_WIDTH) + x + px) * 4;
-                gpu->screen->back_buffer[rgb_index + 0] = value;
-                gpu->screen->back_buffer[rgb_index + 1] = value;
-                gpu->screen->back_buffer[rgb_index + 2] = value;
-                gpu->screen->back_buffer[rgb_index + 3] = 0xFF;
+        if(addr >= 0x8000 && addr < 0xA000) {
+            gpu_vram_wb(gpu, addr & 0x1FFF, v);
+        } else if(addr >= 0xFE00 && addr < 0xFEA0) {
+            gpu_oam_wb(gpu, addr & 0xFF, v);
+        } else {
+            switch(addr) {
+                case GPU_LOG_LINE:
+                    if(v == 0) {
+                        gpu->win_line = 0;
+                    }
+                    gpu->reg_ly = v;
+                    gpu_scanline(gpu);
+                    break;
+                case GPU_LOG_FRAME:
+                    SDL_LockMutex(worker->lock);
+                    worker->front ^= 1;
+                    worker->front_gen = gpu->frame_gen;
+                    SDL_UnlockMutex(worker->lock);
+
+                    /* Unchanged lines are not redrawn, so start from the frame just finished. */
+                    gpu->frame = worker->frames[worker->front ^ 1];
+                    memcpy(gpu->frame, worker->frames[worker->front], sizeof(worker->frames[0]));
+                    break;
+                case GPU_LOG_QUIT:
+                    return 1;
+                case 0xFF40: gpu_io_set_lcdc(gpu, v); break;
+                case 0xFF42: gpu_io_set_scy(gpu, v); break;
+                case 0xFF43: gpu_io_set_scx(gpu, v); break;
+                case 0xFF47: gpu_io_set_bgp(gpu, v); break;
+                case 0xFF48: gpu_io_set_obp0(gpu, v); break;
+                case 0xFF49: gpu_io_set_obp1(gpu, v); break;
+                case 0xFF4A: gpu_io_set_wy(gpu, v); break;
+                case 0xFF4B: gpu_io_set_wx(gpu, v); break;
             }
         }
     }
+
+    return 0;
 }
 
-static void gpu_scanline(struct gpu *gpu) {
-    if(gpu->reg_lcdc & LCDC_BG_ON) {
-        gpu_scanline_background(gpu);
+static int gpu_worker_run(void *data) {
+    struct gpu_worker *worker = data;
+    int quit = 0;
+
+    while(!quit) {
+        SDL_SemWait(worker->ready);
+        quit = gpu_worker_replay(worker, &worker->logs[worker->tail]);
+        worker->tail ^= 1;
+        SDL_SemPost(worker->free);
+    }
+
+    return 0;
+}
+
+static int gpu_worker_start(struct gpu *gpu) {
+    struct gpu_worker *worker = calloc(1, sizeof(struct gpu_worker));
+    if(worker == NULL) {
+        return -1;
+    }
+
+    /* The worker starts from the current state and frame. */
+    gpu_flush(gpu);
+    worker->gpu = *gpu;
+    worker->gpu.deferred = 0;
+    memcpy(worker->frames[0], gpu->frame, sizeof(worker->frames[0]));
+    memcpy(worker->frames[1], gpu->frame, sizeof(worker->frames[1]));
+    worker->gpu.frame = worker->frames[1];
+    worker->front_gen = gpu->frame_gen;
+
+    worker->free = SDL_CreateSemaphore(1);
+    worker->ready = SDL_CreateSemaphore(0);
+    worker->lock = SDL_CreateMutex();
+    if(worker->free != NULL && worker->ready != NULL && worker->lock != NULL) {
+        worker->thread = SDL_CreateThread(gpu_worker_run, "gpu", worker);
     }
 
-    if(gpu->reg_lcdc & LCDC_OBJ_ON) {
-        gpu_scanline_objects(gpu);
+    if(worker->thread == NULL) {
+        fprintf(stderr, "gpu error: failed to start render thread: %s\n", SDL_GetError());
+        if(worker->free != NULL) {
+            SDL_DestroySemaphore(worker->free);
+        }
+        if(worker->ready != NULL) {
+            SDL_DestroySemaphore(worker->ready);
+        }
+        if(worker->lock != NULL) {
+            SDL_DestroyMutex(worker->lock);
+        }
+        free(worker);
+        return -1;
     }
+
+    gpu->worker = worker;
+    return 0;
+}
+
+static void gpu_worker_stop(struct gpu *gpu) {
+    struct gpu_worker *worker = gpu->worker;
+
+    gpu_log(gpu, GPU_LOG_QUIT, 0);
+    SDL_SemPost(worker->ready);
+    SDL_WaitThread(worker->thread, NULL);
+    gpu->worker = NULL;
+
+    /* Take back the last finished frame and bring the tile cache up to date. */
+    memcpy(gpu->frame, worker->frames[worker->front], sizeof(worker->frames[0]));
+    gpu->frame_gen = worker->front_gen;
+    gpu_decode_tiles(gpu);
+    gpu_invalidate_maps(gpu);
+    memset(gpu->line_sigs, 0, sizeof(gpu->line_sigs));
+    gpu->oam_dirty = 1;
+
+    SDL_DestroySemaphore(worker->free);
+    SDL_DestroySemaphore(worker->ready);
+    SDL_DestroyMutex(worker->lock);
+    free(worker);
 }
 
 /*** Public ***/
@@ -175,16 +533,34 @@ void gpu_init(struct gpu *gpu, struct interrupt_controller *ic, struct screen *s
     memset(gpu, 0, sizeof(struct gpu));
     gpu->ic = ic;
     gpu->screen = screen;
+    gpu->frame = screen->back_buffer;
+    gpu->frame_gen = 1;
     gpu->mode = GPU_MODE_OAM;
+    gpu->kernels = pixel_kernels_best();
+    gpu->oam_dirty = 1;
+    gpu_decode_tiles(gpu);
+    gpu_invalidate_maps(gpu);
+
+    for(uint8_t i = 0; i < 4; i++) {
+        gpu->colors[i] = pixel_shade(i);
+    }
+    gpu_build_palette(&gpu->shades[GPU_PAL_BG], gpu->reg_bgp);
+    gpu_build_palette(&gpu->shades[GPU_PAL_OBP0], gpu->reg_obp0);
+    gpu_build_palette(&gpu->shades[GPU_PAL_OBP1], gpu->reg_obp1);
 }
 
 void gpu_cleanup(struct gpu *gpu) {
-    (void)gpu;
+    gpu_set_threaded(gpu, 0);
 }
 
 void gpu_update(struct gpu *gpu, int cycles) {
     assert(gpu->reg_ly < 154);
 
+    if(gpu->engine == GPU_ENGINE_FIFO) {
+        fifo_update(gpu, cycles);
+        return;
+    }
+
     /* Update MODE in STAT. */
     if((gpu->reg_stat & 3) != gpu->mode) {
         gpu->reg_stat = (gpu->reg_stat & 0xFC) | gpu->mode;
@@ -196,6 +572,8 @@ void gpu_update(struct gpu *gpu, int cycles) {
         // gpu->mode = GPU_MODE_OAM; Dr. Mario hangs if not 0?
         gpu->mode = 0;
         gpu->reg_ly = 0;
+        gpu->win_line = 0;
+        gpu_flush(gpu);
         return;
     }
 
@@ -226,8 +604,22 @@ void gpu_update(struct gpu *gpu, int cycles) {
                 gpu->clock %= CYCLES_RAM;
                 gpu->mode = GPU_MODE_HBLANK;
 
+                /* Skipping is decided per frame. */
+                if(gpu->reg_ly == 0) {
+                    gpu->skipping = gpu->skip;
+                }
+
                 /* Do at scanline now. */
-                gpu_scanline(gpu);
+                if(gpu->skipping) {
+                    struct gpu_raster r;
+                    gpu_capture(gpu, &r);
+                } else if(gpu->worker) {
+                    gpu_log(gpu, GPU_LOG_LINE, gpu->reg_ly);
+                } else if(gpu->deferred) {
+                    gpu_defer(gpu);
+                } else {
+                    gpu_scanline(gpu);
+                }
 
                 /* STAT HBLANK interrupt. */
                 if(gpu->reg_stat & STAT_INT_HBLANK) {
@@ -242,6 +634,13 @@ void gpu_update(struct gpu *gpu, int cycles) {
                 if(gpu->reg_ly == 144) {
                     /* Switch HBLANK -> VBLANK */
                     gpu->mode = GPU_MODE_VBLANK;
+                    gpu->frame_done = 1;
+                    gpu_flush(gpu);
+
+                    if(gpu->worker && !gpu->skipping) {
+                        gpu_log(gpu, GPU_LOG_FRAME, 0);
+                        gpu_worker_submit(gpu->worker);
+                    }
 
                     /* VBLANK interrupt */
                     interrupt_controller_trigger(gpu->ic, INT_VBLANK);
@@ -269,6 +668,7 @@ void gpu_update(struct gpu *gpu, int cycles) {
                 if(gpu->reg_ly == 154) {
                     /* Switch VBLANK -> OAM */
                     gpu->reg_ly = 0;
+                    gpu->win_line = 0;
                     gpu->mode = GPU_MODE_OAM;
 
                     /* STAT OAM interrupt. */
@@ -281,6 +681,147 @@ void gpu_update(struct gpu *gpu, int cycles) {
     }
 }
 
+void gpu_vram_wb(struct gpu *gpu, const uint16_t addr, const uint8_t b) {
+    if(gpu->vram[addr] == b) {
+        return;
+    }
+
+    /* Deferred lines must see VRAM as it was when they were drawn. */
+    gpu_flush(gpu);
+    gpu->vram[addr] = b;
+
+    /* The worker keeps its own caches. */
+    if(gpu->worker) {
+        gpu_log(gpu, 0x8000 + addr, b);
+    } else if(addr < 0x1800) {
+        gpu_decode_tile_row(gpu, addr);
+        gpu->tile_gen++;
+        gpu->map_tile_dirty[0][addr >> 4] = gpu->map_tile_dirty[1][addr >> 4] = 1;
+        gpu->map_dirty[0] = gpu->map_dirty[1] = 1;
+    } else {
+        int m = (addr >> 10) & 1;
+        gpu->map_cell_dirty[m][addr & 0x3FF] = 1;
+        gpu->map_gen[m]++;
+        gpu->map_dirty[m] = 1;
+    }
+}
+
+void gpu_oam_wb(struct gpu *gpu, const uint16_t addr, const uint8_t b) {
+    if(gpu->oam[addr] != b) {
+        gpu_flush(gpu);
+        gpu->oam[addr] = b;
+        gpu->oam_dirty = 1;
+        gpu_log(gpu, 0xFE00 + addr, b);
+    }
+}
+
+void gpu_skip_frame(struct gpu *gpu, int skip) {
+    gpu->skip = skip;
+}
+
+/* Whether a frame was completed since the last call. */
+int gpu_frame_done(struct gpu *gpu) {
+    int done = gpu->frame_done;
+    gpu->frame_done = 0;
+    return done;
+}
+
+void gpu_set_deferred(struct gpu *gpu, int enabled) {
+    gpu_flush(gpu);
+    gpu->deferred = enabled;
+}
+
+int gpu_set_threaded(struct gpu *gpu, int enabled) {
+    if(enabled && gpu->engine != GPU_ENGINE_SCANLINE) {
+        fprintf(stderr, "gpu error: threaded rendering needs the scanline engine\n");
+        return -1;
+    }
+    if(enabled && gpu->worker == NULL) {
+        return gpu_worker_start(gpu);
+    }
+    if(!enabled && gpu->worker != NULL) {
+        gpu_worker_stop(gpu);
+    }
+    return 0;
+}
+
+int gpu_set_engine(struct gpu *gpu, enum gpu_engine engine) {
+    if(engine == gpu->engine) {
+        return 0;
+    }
+    if(gpu->worker != NULL) {
+        fprintf(stderr, "gpu error: can't switch engine while rendering threaded\n");
+        return -1;
+    }
+
+    gpu_flush(gpu);
+    memset(gpu->line_sigs, 0, sizeof(gpu->line_sigs));
+
+    /* Carry the position in the line over, the lines drawn so far are kept. */
+    if(engine == GPU_ENGINE_FIFO) {
+        fifo_reset(gpu);
+    } else {
+        int dot = gpu->fifo.dot;
+        switch(gpu->mode) {
+            case GPU_MODE_OAM:
+                gpu->clock = dot < CYCLES_OAM ? dot : CYCLES_OAM - 1;
+                break;
+            case GPU_MODE_RAM:
+                gpu->clock = dot - CYCLES_OAM < CYCLES_RAM ? dot - CYCLES_OAM : CYCLES_RAM - 1;
+                break;
+            case GPU_MODE_HBLANK:
+                gpu->clock = dot > CYCLES_LINE - CYCLES_HBLANK ? dot - (CYCLES_LINE - CYCLES_HBLANK) : 0;
+                break;
+            case GPU_MODE_VBLANK:
+                gpu->clock = dot;
+                break;
+        }
+        gpu->oam_dirty = 1;
+    }
+
+    gpu->engine = engine;
+    return 0;
+}
+
+void gpu_present(struct gpu *gpu) {
+    struct gpu_worker *worker = gpu->worker;
+    if(worker == NULL) {
+        return;
+    }
+
+    SDL_LockMutex(worker->lock);
+    if(gpu->frame_gen != worker->front_gen) {
+        memcpy(gpu->frame, worker->frames[worker->front], sizeof(worker->frames[0]));
+        gpu->frame_gen = worker->front_gen;
+    }
+    SDL_UnlockMutex(worker->lock);
+}
+
+int gpu_frame_changed(const struct gpu *gpu, struct gpu_frame_watch *watch) {
+    if(watch->gen == gpu->frame_gen) {
+        return 0;
+    }
+    watch->gen = gpu->frame_gen;
+
+    if(!watch->hash_frames) {
+        return 1;
+    }
+
+    /* Lines can be redrawn with the same pixels, compare a hash of the frame too. */
+    const uint64_t *p = (const uint64_t *)gpu->frame;
+    uint64_t hash = 0x9E3779B97F4A7C15;
+    for(size_t i = 0; i < sizeof(pixel_t) * PIXEL_OFFSET(SCREEN_WIDTH * SCREEN_HEIGHT) / 8; i++) {
+        hash = (hash ^ p[i]) * 0x100000001B3;
+        hash ^= hash >> 29;
+    }
+
+    if(hash == watch->hash) {
+        return 0;
+    }
+    watch->hash = hash;
+    return 1;
+}
+
 uint8_t gpu_io_lcdc(const struct gpu *gpu) {
     return gpu->reg_lcdc;
 }
@@ -330,6 +871,7 @@ uint8_t gpu_io_wx(const struct gpu *gpu) {
 }
 
 void gpu_io_set_lcdc(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF40, v);
     gpu->reg_lcdc = v;
 }
 
@@ -338,10 +880,12 @@ void gpu_io_set_stat(struct gpu *gpu, const uint8_t v) {
 }
 
 void gpu_io_set_scy(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF42, v);
     gpu->reg_scy = v;
 }
 
 void gpu_io_set_scx(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF43, v);
     gpu->reg_scx = v;
 }
 
@@ -359,21 +903,29 @@ void gpu_io_set_dma(struct gpu *gpu, const uint8_t v) {
 }
 
 void gpu_io_set_bgp(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF47, v);
     gpu->reg_bgp = v;
+    gpu_build_palette(&gpu->shades[GPU_PAL_BG], v);
 }
 
 void gpu_io_set_obp0(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF48, v);
     gpu->reg_obp0 = v;
+    gpu_build_palette(&gpu->shades[GPU_PAL_OBP0], v);
 }
 
 void gpu_io_set_obp1(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF49, v);
     gpu->reg_obp1 = v;
+    gpu_build_palette(&gpu->shades[GPU_PAL_OBP1], v);
 }
 
 void gpu_io_set_wy(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF4A, v);
     gpu->reg_wy = v;
 }
 
 void gpu_io_set_wx(struct gpu *gpu, const uint8_t v) {
+    gpu_log(gpu, 0xFF4B, v);
     gpu->reg_wx = v;
 }
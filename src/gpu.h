@@ -6,11 +6,64 @@
  *
  *  A lot of confusing stuff here. :)
  *
+ *  Threaded rendering
+ *  ------------------
+ *
+ *  With gpu_set_threaded() the emulation thread no longer renders. It
+ *  only logs the writes that affect the picture (LCDC, scroll, window and
+ *  palette registers, VRAM and OAM) together with a marker for every line
+ *  and frame. A worker thread replays the log into its own copy of the GPU
+ *  and renders into one half of a double buffer, while the CPU carries on
+ *  with the next frame. gpu_present() copies the last finished frame to
+ *  the screen.
+ *
+ *  Deferred rendering
+ *  ------------------
+ *
+ *  With gpu_set_deferred() each line only captures its raster registers
+ *  (struct gpu_raster) and the whole frame is rendered in one go at VBLANK.
+ *  A VRAM or OAM write renders the pending lines first, so the result is
+ *  the same as rendering each line as it is reached.
+ *
+ *  Frame skipping
+ *  --------------
+ *
+ *  gpu_skip_frame() asks for the following frames not to be drawn. It is
+ *  latched when a frame starts (LY 0), so a frame is either drawn in full
+ *  or not at all. Mode, LY, STAT and interrupt timing are unaffected and
+ *  the frame buffer keeps the last drawn frame.
+ *
+ *  gpu_frame_done() tells when a frame has been completed (LY 144), drawn
+ *  or skipped. That is when to show it and decide on the next one: the
+ *  LCD being turned off and on restarts the frame at any time, so a count
+ *  of cycles does not stay in step with it.
+ *
+ *  Engines
+ *  -------
+ *
+ *  The scanline engine above draws a line at a time and is what the
+ *  threaded, deferred and memoized paths build on. gpu_set_engine() swaps
+ *  in the pixel FIFO engine (fifo.h) instead, which runs dot by dot with
+ *  a variable length mode 3. Both share the registers, VRAM, OAM, the
+ *  tile cache and the composed lines, so the rest of the emulator does
+ *  not care which one is running.
+ *
+ *  Frame changes
+ *  -------------
+ *
+ *  frame_gen advances whenever pixels are written to the frame. Each
+ *  consumer (the screen, a recorder, ...) keeps a struct gpu_frame_watch
+ *  and asks gpu_frame_changed() whether there is anything new to show.
+ *  Optionally a hash of the frame is compared as well, to catch lines that
+ *  were redrawn with the same pixels.
+ *
  */
 #ifndef GBOY_GPU_H
 #define GBOY_GPU_H
 
 #include <inttypes.h>
+#include "pixel.h"
+#include "fifo.h"
 
 #define LCDC_ON             0x80
 #define LCDC_WIN_MAP        0x40
@@ -28,6 +81,20 @@
 #define STAT_MATCH          0x04 /* Write to MATCH set it to 0 */
 #define STAT_MODE           0x03
 
+#define OBJ_ATTR_PRIORITY       0x80
+#define OBJ_ATTR_VFLIP          0x40
+#define OBJ_ATTR_HFLIP          0x20
+#define OBJ_ATTR_PALETTE        0x10
+#define OBJ_ATTR_BANK_CGB       0x08
+#define OBJ_ATTR_PALETTE_CGB    0x07
+
+struct obj {
+    uint8_t y;
+    uint8_t x;
+    uint8_t tile_id;
+    uint8_t attr;
+} __attribute__ ((packed));
+
 enum gpu_mode {
     GPU_MODE_HBLANK,        /* Mode 00 - CPU has access to VRAM */
     GPU_MODE_VBLANK,        /* Mode 01 - CPU has access to VRAM */
@@ -35,6 +102,54 @@ enum gpu_mode {
     GPU_MODE_RAM,           /* Mode 11 - OAM and VRAM in use */
 };
 
+/* Offsets of each palette in gpu->shades. */
+enum gpu_palette {
+    GPU_PAL_BG          = 0,
+    GPU_PAL_OBP0        = 4,
+    GPU_PAL_OBP1        = 8,
+    GPU_PAL_BLANK       = 12,   /* Background turned off (always shade 0). */
+};
+
+enum gpu_engine {
+    GPU_ENGINE_SCANLINE,    /* Whole lines at the end of mode 3 (gpu.c). */
+    GPU_ENGINE_FIFO,        /* Dot by dot pixel FIFO (fifo.c). */
+};
+
+/* Registers a line is drawn with, captured at the start of the line. */
+struct gpu_raster {
+    uint8_t ly;
+    uint8_t lcdc;
+    uint8_t scy;
+    uint8_t scx;
+    uint8_t wy;
+    uint8_t wx;
+    uint8_t bgp;
+    uint8_t obp0;
+    uint8_t obp1;
+    uint8_t win_line;       /* Window line counter. */
+};
+
+/*
+ *  Everything the pixels of a line depend on. A line with the same
+ *  signature as when it was last drawn is skipped, keeping the old pixels.
+ *  The generations count changes to tile data, each tile map and the
+ *  objects on the line.
+ */
+struct gpu_line_sig {
+    struct gpu_raster raster;
+    uint8_t valid;
+    uint32_t tile_gen;
+    uint32_t map_gen[2];
+    uint32_t obj_gen;
+};
+
+/* A consumer's view of the frame, see gpu_frame_changed(). */
+struct gpu_frame_watch {
+    uint32_t gen;           /* Frame generation last seen. */
+    int hash_frames;        /* Also compare frame hashes. */
+    uint64_t hash;
+};
+
 struct gpu {
     uint8_t reg_lcdc;       /* 0xFF40 */
     uint8_t reg_stat;       /* 0xFF41 */
@@ -51,8 +166,79 @@ struct gpu {
 
     uint8_t vram[0x2000];   /* 0x8000 - 0xA000 */
     uint8_t oam[0xA0];      /* 0xFE00 - 0xFEA0 */
+
+    /*
+     *  The 384 tiles in 0x8000 - 0x9800 decoded to one color index (0-3)
+     *  per byte, indexed as [hflip][tile][row][x]. Rows are re-decoded on
+     *  every write to tile data (see gpu_vram_wb).
+     */
+    uint8_t tiles[2][384][8][8];
+
+    /*
+     *  The two 32x32 tile maps (0x9800 and 0x9C00) drawn out as 256x256
+     *  color indices, so a background or window line is a wrap-around copy.
+     *  A map is redrawn on use where its entries or the tiles they refer to
+     *  have changed, or in full if it was drawn with the other tile data
+     *  area (LCDC.4).
+     */
+    uint8_t maps[2][256][256];
+    uint8_t map_dirty[2];
+    uint8_t map_cell_dirty[2][1024];
+    uint8_t map_tile_dirty[2][384];
+    int8_t map_signed[2];   /* Signed tile ids (1), unsigned (0) or not drawn (-1). */
+
+    /*
+     *  Objects (OAM indices) on each line, at most 10 and in drawing
+     *  priority order. Rebuilt before the next scanline when OAM or the
+     *  object size has changed.
+     */
+    uint8_t obj_lines[144][10];
+    uint8_t obj_count[144];
+    uint8_t obj_height;     /* Object size the buckets were built for. */
+    int oam_dirty;
+    uint8_t obj_data[144][40];  /* OAM entries of the objects on each line. */
+    uint32_t obj_gen[144];
+
+    struct gpu_line_sig line_sigs[144];
+    uint32_t tile_gen;
+    uint32_t map_gen[2];
+
+    /*
+     *  A scanline is first composed as palette qualified color indices
+     *  (see enum gpu_palette), then mapped to screen pixels in one pass:
+     *
+     *      pixel = colors[shades[lines[y][x]]]
+     *
+     *  shades holds the BGP, OBP0 and OBP1 registers as 4 shades each and
+     *  is rebuilt when they are written. line_shades keeps the shades each
+     *  line was mapped with, palettes can change between lines.
+     */
+    uint8_t lines[144][160];
+    uint8_t shades[16];
+    uint8_t line_shades[144][16];
+    pixel_t colors[4];
+    const struct pixel_kernels *kernels;
+
+    /* Deferred lines raster_from - raster_to, not rendered yet. */
+    int deferred;
+    struct gpu_raster raster[144];
+    int raster_from;
+    int raster_to;
+
+    int skip;               /* Skip frames from the next LY 0 on. */
+    int skipping;           /* Current frame is skipped. */
+    int frame_done;         /* LY 144 was reached, see gpu_frame_done(). */
+
+    pixel_t *frame;         /* Frame being rendered, 160x144 pixels. */
+    uint32_t frame_gen;     /* Advances when pixels in frame change. */
+    struct gpu_worker *worker;
+
+    enum gpu_engine engine;
+    struct fifo fifo;
+
     enum gpu_mode mode;
     int clock;
+    uint8_t win_line;       /* Window line counter. */
 
     struct interrupt_controller *ic;
     struct screen *screen;
@@ -62,6 +248,15 @@ void gpu_init(struct gpu *gpu, struct interrupt_controller *ic, struct screen *s
 void gpu_cleanup(struct gpu *gpu);
 void gpu_update(struct gpu *gpu, int cycles);
 void gpu_debug_tiles(struct gpu *gpu);
+void gpu_vram_wb(struct gpu *gpu, const uint16_t addr, const uint8_t b);
+void gpu_oam_wb(struct gpu *gpu, const uint16_t addr, const uint8_t b);
+void gpu_skip_frame(struct gpu *gpu, int skip);
+int gpu_frame_done(struct gpu *gpu);
+void gpu_set_deferred(struct gpu *gpu, int enabled);
+int gpu_set_threaded(struct gpu *gpu, int enabled);
+int gpu_set_engine(struct gpu *gpu, enum gpu_engine engine);
+void gpu_present(struct gpu *gpu);
+int gpu_frame_changed(const struct gpu *gpu, struct gpu_frame_watch *watch);
 
 uint8_t gpu_io_lcdc(const struct gpu *gpu);
 uint8_t gpu_io_stat(const struct gpu *gpu);
@@ -1,6 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "gboy.h"
+#include "observe.h"
 
 #include "mmu.h"
 #include "cpu.h"
@@ -20,14 +23,159 @@ void test() {
     printf("A <- 0x%02X\n", cpu.a);
 }
 
+static const char *PACE_NAMES[] = {
+    [PACE_MONOTONIC]    = "timer",
+    [PACE_AUDIO]        = "audio",
+    [PACE_VSYNC]        = "vsync",
+    [PACE_OFF]          = "off",
+};
+
+/* Observations of each drawn frame, written to a file or pipe. */
+struct observer {
+    struct observe obs;
+    FILE *out;
+    uint8_t *buf;
+};
+
+static void observer_frame(struct gboy *gb, void *user) {
+    struct observer *o = user;
+    size_t size = observe_size(&o->obs);
+    if(observe_frame(&o->obs, &gb->gpu, o->buf) != 0 || fwrite(o->buf, 1, size, o->out) != size ||
+            fflush(o->out) != 0) {
+        fprintf(stderr, "observe error: observations stopped\n");
+        gb->frame_hook = NULL;
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-d] [-t] [-f] [-H] [-s N] [-F FILTER] [-p CLOCK] [-c FILE [-w]] [-o FILE [-O]] ROM-FILE\n", name);
+    fprintf(stderr, "  -d    render whole frames at VBLANK\n");
+    fprintf(stderr, "  -t    render on a separate thread\n");
+    fprintf(stderr, "  -f    use the pixel FIFO engine (slow, cycle accurate)\n");
+    fprintf(stderr, "  -H    compare frame hashes before showing a frame\n");
+    fprintf(stderr, "  -s N  skip N frames after each drawn frame\n");
+    fprintf(stderr, "  -F X  upscale with filter X (key F cycles):");
+    for(int i = 0; i < FILTER_COUNT; i++) {
+        fprintf(stderr, " %s", FILTERS[i].name);
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  -p X  pace frames by clock X: timer (default), audio, vsync, off\n");
+    fprintf(stderr, "  -c F  record to F (Y4M if it ends in .y4m, else raw RGB24) and F.wav\n");
+    fprintf(stderr, "  -w    wait for the disk when recording instead of dropping frames\n");
+    fprintf(stderr, "  -o F  write 4 stacked, max-pooled 84x84 gray observations per drawn\n");
+    fprintf(stderr, "        frame to F (a file or pipe), see observe.h\n");
+    fprintf(stderr, "  -O    observe one plane per shade instead of gray\n");
+    exit(1);
+}
+
 int main(int argc, char *argv[]) {
-    if(argc < 2) {
-        fprintf(stderr, "Usage: %s ROM-FILE\n", argv[0]);
-        exit(1);
+    int deferred = 0;
+    int threaded = 0;
+    int fifo = 0;
+    int frame_skip = 0;
+    int hash_frames = 0;
+    const struct filter *filter = NULL;
+    int pace = PACE_MONOTONIC;
+    const char *capture = NULL;
+    enum capture_policy capture_policy = CAPTURE_DROP;
+    const char *observe = NULL;
+    enum observe_format observe_format = OBSERVE_GRAY;
+    int opt;
+    while((opt = getopt(argc, argv, "dtfHs:F:p:c:wo:O")) != -1) {
+        switch(opt) {
+            case 'd': deferred = 1; break;
+            case 't': threaded = 1; break;
+            case 'f': fifo = 1; break;
+            case 'H': hash_frames = 1; break;
+            case 's': frame_skip = atoi(optarg); break;
+            case 'c': capture = optarg; break;
+            case 'w': capture_policy = CAPTURE_WAIT; break;
+            case 'o': observe = optarg; break;
+            case 'O': observe_format = OBSERVE_PLANES; break;
+            case 'F':
+                filter = filter_find(optarg);
+                if(filter == NULL) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'p':
+                for(pace = 0; pace <= PACE_OFF && strcmp(PACE_NAMES[pace], optarg) != 0; pace++) {
+                }
+                if(pace > PACE_OFF) {
+                    usage(argv[0]);
+                }
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if(optind >= argc || frame_skip < 0) {
+        usage(argv[0]);
     }
+    if(observe != NULL && threaded) {
+        fprintf(stderr, "observe error: no lines with threaded rendering\n");
+        return 1;
+    }
+
     struct gboy gb;
     gboy_init(&gb);
-    gboy_run(&gb, argv[1]);
+    gb.frame_skip = frame_skip;
+    gb.screen_watch.hash_frames = hash_frames;
+    if(filter != NULL) {
+        screen_set_filter(&gb.screen, filter);
+    }
+    if(pace == PACE_VSYNC && screen_set_vsync(&gb.screen, 1) != 0) {
+        pace = PACE_MONOTONIC;
+    }
+    pace_set_clock(&gb.pace, (enum pace_clock)pace);
+    if(fifo) {
+        gpu_set_engine(&gb.gpu, GPU_ENGINE_FIFO);
+    }
+    if(deferred) {
+        gpu_set_deferred(&gb.gpu, 1);
+    }
+    if(threaded) {
+        gpu_set_threaded(&gb.gpu, 1);
+    }
+    if(capture != NULL) {
+        size_t len = strlen(capture);
+        enum capture_format format = (len >= 4 && strcmp(&capture[len - 4], ".y4m") == 0)
+            ? CAPTURE_Y4M : CAPTURE_RGB;
+        if(capture_start(&gb.capture, capture, format, capture_policy, frame_skip + 1,
+                gb.apu.dev != 0 ? gb.apu.freq : 0) != 0) {
+            gboy_cleanup(&gb);
+            return 1;
+        }
+    }
+
+    struct observer observer;
+    memset(&observer, 0, sizeof(observer));
+    if(observe != NULL) {
+        if(observe_init(&observer.obs, observe_format, 4, 1) != 0) {
+            gboy_cleanup(&gb);
+            return 1;
+        }
+        observer.out = fopen(observe, "wb");
+        observer.buf = malloc(observe_size(&observer.obs));
+        if(observer.out == NULL || observer.buf == NULL) {
+            fprintf(stderr, "observe error: can't open %s\n", observe);
+            if(observer.out != NULL) {
+                fclose(observer.out);
+            }
+            free(observer.buf);
+            observe_cleanup(&observer.obs);
+            gboy_cleanup(&gb);
+            return 1;
+        }
+        gb.frame_hook = observer_frame;
+        gb.frame_hook_user = &observer;
+    }
+
+    gboy_run(&gb, argv[optind]);
     gboy_cleanup(&gb);
+    if(observe != NULL) {
+        fclose(observer.out);
+        free(observer.buf);
+        observe_cleanup(&observer.obs);
+    }
     return 0;
 }
@@ -0,0 +1,348 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "mbc.h"
+#include "cpu.h"
+
+#define CYCLES_PER_SEC      4194304ULL
+#define SECS_PER_DAY        86400ULL
+#define RTC_DAYS            512ULL      /* 9-bit day counter. */
+
+#define ROM_BANK_SIZE       0x4000
+#define RAM_BANK_SIZE       0x2000
+#define RTC_TRAILER_SIZE    48
+
+/*** Private ***/
+
+static uint32_t get_ram_size(const uint8_t code) {
+    switch(code) {
+        case 1: return 0x0800;
+        case 2: return 0x2000;
+        case 3: return 0x8000;
+        case 4: return 0x20000;
+        case 5: return 0x10000;
+    }
+    return 0;
+}
+
+static void put_le32(uint8_t *p, const uint32_t v) {
+    for(int i = 0; i < 4; i++) {
+        p[i] = (uint8_t)(v >> (i * 8));
+    }
+}
+
+static uint64_t get_le(const uint8_t *p, const int n) {
+    uint64_t v = 0;
+    for(int i = n - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+/* Point rom0 and rom1 at the currently selected banks. */
+static void mbc_map(struct mbc *mbc) {
+    uint32_t banks = mbc->rom_size / ROM_BANK_SIZE;
+    uint32_t lo = 0;
+    uint32_t hi = mbc->rom_bank;
+
+    if(mbc->type == MBC_1) {
+        /* The RAM bank register holds bit 5-6 of the ROM bank. */
+        hi |= (uint32_t)(mbc->ram_bank << 5);
+        if(mbc->mode) {
+            lo = (uint32_t)(mbc->ram_bank << 5);
+        }
+    }
+
+    mbc->rom0 = &mbc->rom[(lo % banks) * ROM_BANK_SIZE];
+    mbc->rom1 = &mbc->rom[(hi % banks) * ROM_BANK_SIZE];
+}
+
+/* Offset in external RAM for an address in 0xA000 - 0xC000. */
+static uint32_t mbc_ram_offset(const struct mbc *mbc, const uint16_t addr) {
+    uint32_t bank = mbc->ram_bank;
+    if(mbc->type == MBC_1 && mbc->mode == 0) {
+        bank = 0;
+    }
+    return (bank * RAM_BANK_SIZE + (addr & 0x1FFF)) % mbc->ram_size;
+}
+
+/* Clock value in cycles. */
+static uint64_t rtc_time(const struct mbc *mbc) {
+    if(mbc->rtc.halt) {
+        return mbc->rtc.frozen;
+    }
+    return (uint64_t)((int64_t)mbc->cpu->cycles - mbc->rtc.epoch);
+}
+
+static void rtc_set_time(struct mbc *mbc, const uint64_t t) {
+    if(mbc->rtc.halt) {
+        mbc->rtc.frozen = t;
+    } else {
+        mbc->rtc.epoch = (int64_t)mbc->cpu->cycles - (int64_t)t;
+    }
+}
+
+static uint64_t rtc_regs_to_secs(const uint8_t *regs) {
+    uint64_t days = regs[RTC_DL] | (uint64_t)(regs[RTC_DH] & RTC_DH_DAY) << 8;
+    return ((days * 24 + regs[RTC_H]) * 60 + regs[RTC_M]) * 60 + regs[RTC_S];
+}
+
+/* Compute the clock registers. Overflowing the day counter sets carry. */
+static void rtc_read(struct mbc *mbc, uint8_t *regs) {
+    uint64_t t = rtc_time(mbc);
+    uint64_t secs = t / CYCLES_PER_SEC;
+    uint64_t days = secs / SECS_PER_DAY;
+
+    if(days >= RTC_DAYS) {
+        uint64_t wrap = (days / RTC_DAYS) * RTC_DAYS * SECS_PER_DAY;
+        mbc->rtc.carry = 1;
+        rtc_set_time(mbc, t - wrap * CYCLES_PER_SEC);
+        secs -= wrap;
+        days %= RTC_DAYS;
+    }
+
+    regs[RTC_S] = (uint8_t)(secs % 60);
+    regs[RTC_M] = (uint8_t)(secs / 60 % 60);
+    regs[RTC_H] = (uint8_t)(secs / 3600 % 24);
+    regs[RTC_DL] = (uint8_t)days;
+    regs[RTC_DH] = (uint8_t)((days >> 8) & RTC_DH_DAY);
+    regs[RTC_DH] |= mbc->rtc.halt ? RTC_DH_HALT : 0;
+    regs[RTC_DH] |= mbc->rtc.carry ? RTC_DH_CARRY : 0;
+}
+
+static void rtc_write(struct mbc *mbc, const enum rtc_reg reg, const uint8_t b) {
+    uint8_t regs[5];
+    rtc_read(mbc, regs);
+    uint64_t sub = rtc_time(mbc) % CYCLES_PER_SEC;
+
+    switch(reg) {
+        case RTC_S: regs[RTC_S] = b & 0x3F; sub = 0; break; /* Resets the prescaler. */
+        case RTC_M: regs[RTC_M] = b & 0x3F; break;
+        case RTC_H: regs[RTC_H] = b & 0x1F; break;
+        case RTC_DL: regs[RTC_DL] = b; break;
+        case RTC_DH:
+            regs[RTC_DH] = b & (RTC_DH_DAY | RTC_DH_HALT | RTC_DH_CARRY);
+            mbc->rtc.carry = (b & RTC_DH_CARRY) != 0;
+            mbc->rtc.halt = (b & RTC_DH_HALT) != 0;
+            break;
+    }
+
+    rtc_set_time(mbc, rtc_regs_to_secs(regs) * CYCLES_PER_SEC + sub);
+    mbc->rtc.regs[reg] = regs[reg];
+}
+
+static void mbc1_wb(struct mbc *mbc, const uint16_t addr, const uint8_t b) {
+    switch(addr >> 13) {
+        case 0: mbc->ram_enabled = (b & 0x0F) == 0x0A; break;
+        case 1: mbc->rom_bank = (b & 0x1F) ? (b & 0x1F) : 1; break;
+        case 2: mbc->ram_bank = b & 0x03; break;
+        case 3: mbc->mode = b & 0x01; break;
+    }
+    mbc_map(mbc);
+}
+
+static void mbc3_wb(struct mbc *mbc, const uint16_t addr, const uint8_t b) {
+    switch(addr >> 13) {
+        case 0: mbc->ram_enabled = (b & 0x0F) == 0x0A; break;
+        case 1: mbc->rom_bank = (b & 0x7F) ? (b & 0x7F) : 1; break;
+        case 2: mbc->ram_bank = b & 0x0F; break;
+        case 3:
+            /* Writing 0x00 then 0x01 latches the clock. */
+            if(mbc->timer && mbc->rtc.latch == 0x00 && b == 0x01) {
+                rtc_read(mbc, mbc->rtc.regs);
+            }
+            mbc->rtc.latch = b;
+            break;
+    }
+    mbc_map(mbc);
+}
+
+/*** Public ***/
+
+void mbc_init(struct mbc *mbc, struct cpu *cpu) {
+    memset(mbc, 0, sizeof(struct mbc));
+    mbc->cpu = cpu;
+    mbc->rom_bank = 1;
+    mbc->rtc.latch = 0xFF;
+}
+
+void mbc_cleanup(struct mbc *mbc) {
+    free(mbc->ram);
+    mbc->ram = NULL;
+}
+
+int mbc_load(struct mbc *mbc, const struct cartridge *cartridge) {
+    const struct cartridge_header *header = (const struct cartridge_header *)&cartridge->data[0x100];
+
+    switch(header->type) {
+        case 0x00: mbc->type = MBC_NONE; break;
+        case 0x01: case 0x02: mbc->type = MBC_1; break;
+        case 0x03: mbc->type = MBC_1; mbc->battery = 1; break;
+        case 0x08: mbc->type = MBC_NONE; break;
+        case 0x09: mbc->type = MBC_NONE; mbc->battery = 1; break;
+        case 0x0F: case 0x10: mbc->type = MBC_3; mbc->battery = 1; mbc->timer = 1; break;
+        case 0x11: case 0x12: mbc->type = MBC_3; break;
+        case 0x13: mbc->type = MBC_3; mbc->battery = 1; break;
+        default:
+            fprintf(stderr, "mbc error: unsupported cartridge type 0x%02X\n", header->type);
+            return -1;
+    }
+
+    mbc->rom = (const uint8_t *)cartridge->data;
+    mbc->rom_size = cartridge->size - (cartridge->size % ROM_BANK_SIZE);
+    mbc->ram_size = get_ram_size(header->ram_size);
+    if(mbc->type == MBC_NONE && mbc->ram_size > RAM_BANK_SIZE) {
+        mbc->ram_size = RAM_BANK_SIZE;
+    }
+
+    if(mbc->ram_size > 0) {
+        mbc->ram = malloc(mbc->ram_size);
+        if(mbc->ram == NULL) {
+            return -1;
+        }
+        memset(mbc->ram, 0xFF, mbc->ram_size);
+    }
+
+    /* ROM only cartridges have their RAM (if any) always enabled. */
+    mbc->ram_enabled = mbc->type == MBC_NONE;
+    mbc_map(mbc);
+    return 0;
+}
+
+uint8_t mbc_rb(const struct mbc *mbc, const uint16_t addr) {
+    if(addr < 0x4000) {
+        return mbc->rom0[addr];
+    } else if(addr < 0x8000) {
+        return mbc->rom1[addr & 0x3FFF];
+    }
+
+    if(!mbc->ram_enabled) {
+        return 0xFF;
+    }
+
+    if(mbc->type == MBC_3 && mbc->ram_bank >= 0x08) {
+        if(!mbc->timer || mbc->ram_bank > 0x0C) {
+            return 0xFF;
+        }
+        return mbc->rtc.regs[mbc->ram_bank - 0x08];
+    }
+
+    if(mbc->ram_size == 0) {
+        return 0xFF;
+    }
+    return mbc->ram[mbc_ram_offset(mbc, addr)];
+}
+
+void mbc_wb(struct mbc *mbc, const uint16_t addr, const uint8_t b) {
+    if(addr < 0x8000) {
+        switch(mbc->type) {
+            case MBC_NONE: break;
+            case MBC_1: mbc1_wb(mbc, addr, b); break;
+            case MBC_3: mbc3_wb(mbc, addr, b); break;
+        }
+        return;
+    }
+
+    if(!mbc->ram_enabled) {
+        return;
+    }
+
+    if(mbc->type == MBC_3 && mbc->ram_bank >= 0x08) {
+        if(mbc->timer && mbc->ram_bank <= 0x0C) {
+            rtc_write(mbc, (enum rtc_reg)(mbc->ram_bank - 0x08), b);
+        }
+        return;
+    }
+
+    if(mbc->ram_size != 0) {
+        mbc->ram[mbc_ram_offset(mbc, addr)] = b;
+    }
+}
+
+int mbc_load_save(struct mbc *mbc, const char *path) {
+    if(!mbc->battery) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "rb");
+    if(fp == NULL) {
+        /* No save yet. */
+        return 0;
+    }
+
+    if(mbc->ram_size > 0 && fread(mbc->ram, mbc->ram_size, 1, fp) != 1) {
+        fprintf(stderr, "mbc error: failed to read RAM from %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+
+    uint8_t trailer[RTC_TRAILER_SIZE];
+    size_t n = fread(trailer, 1, sizeof(trailer), fp);
+    fclose(fp);
+
+    /* Some emulators store a 32-bit timestamp, making the trailer 44 bytes. */
+    if(!mbc->timer || (n != RTC_TRAILER_SIZE && n != RTC_TRAILER_SIZE - 4)) {
+        return 0;
+    }
+
+    uint8_t regs[5];
+    for(int i = 0; i < 5; i++) {
+        regs[i] = (uint8_t)get_le(&trailer[i * 4], 4);
+        mbc->rtc.regs[i] = (uint8_t)get_le(&trailer[20 + i * 4], 4);
+    }
+    mbc->rtc.halt = (regs[RTC_DH] & RTC_DH_HALT) != 0;
+    mbc->rtc.carry = (regs[RTC_DH] & RTC_DH_CARRY) != 0;
+
+    /* Let the clock run for as long as the emulator was not. */
+    uint64_t secs = rtc_regs_to_secs(regs);
+    uint64_t saved = get_le(&trailer[40], (int)n - 40);
+    uint64_t now = (uint64_t)time(NULL);
+    if(!mbc->rtc.halt && now > saved) {
+        secs += now - saved;
+    }
+    rtc_set_time(mbc, secs * CYCLES_PER_SEC);
+
+    return 0;
+}
+
+int mbc_save(struct mbc *mbc, const char *path) {
+    if(!mbc->battery || (mbc->ram_size == 0 && !mbc->timer)) {
+        return 0;
+    }
+
+    FILE *fp = fopen(path, "wb");
+    if(fp == NULL) {
+        fprintf(stderr, "mbc error: failed to open %s for writing\n", path);
+        return -1;
+    }
+
+    int ret = 0;
+    if(mbc->ram_size > 0 && fwrite(mbc->ram, mbc->ram_size, 1, fp) != 1) {
+        ret = -1;
+    }
+
+    if(mbc->timer) {
+        uint8_t trailer[RTC_TRAILER_SIZE];
+        uint8_t regs[5];
+        uint64_t now = (uint64_t)time(NULL);
+
+        rtc_read(mbc, regs);
+        for(int i = 0; i < 5; i++) {
+            put_le32(&trailer[i * 4], regs[i]);
+            put_le32(&trailer[20 + i * 4], mbc->rtc.regs[i]);
+        }
+        put_le32(&trailer[40], (uint32_t)now);
+        put_le32(&trailer[44], (uint32_t)(now >> 32));
+
+        if(fwrite(trailer, sizeof(trailer), 1, fp) != 1) {
+            ret = -1;
+        }
+    }
+
+    fclose(fp);
+    if(ret != 0) {
+        fprintf(stderr, "mbc error: failed to write %s\n", path);
+    }
+    return ret;
+}
@@ -0,0 +1,92 @@
+/*
+ *  mbc.h
+ *  =====
+ *
+ *  Emulate the memory bank controller (MBC) of the cartridge.
+ *
+ *  Supported controllers:
+ *
+ *      none    - 32 KiB ROM, optionally 8 KiB RAM.
+ *      MBC1    - up to 2 MiB ROM and 32 KiB RAM.
+ *      MBC3    - up to 2 MiB ROM, 32 KiB RAM and a real-time clock (RTC).
+ *
+ *  The MBC3 clock is never ticked. It remembers the CPU cycle at which it
+ *  read zero (the epoch), and the clock registers are computed from the
+ *  current cycle count only when they are latched or written. While the
+ *  clock is halted the elapsed time is frozen instead.
+ *
+ *  Battery backed RAM (and the clock) is stored in a .sav file next to the
+ *  ROM, using the common 48 byte RTC trailer:
+ *
+ *      5 x uint32  - current S, M, H, DL, DH
+ *      5 x uint32  - latched S, M, H, DL, DH
+ *      1 x uint64  - UNIX time of the save
+ *
+ *  The clock is advanced by the host time that passed between sessions.
+ *
+ */
+#ifndef GBOY_MBC_H
+#define GBOY_MBC_H
+
+#include <inttypes.h>
+#include "cartridge.h"
+
+enum mbc_type {
+    MBC_NONE,
+    MBC_1,
+    MBC_3,
+};
+
+enum rtc_reg {
+    RTC_S,                  /* 0x08 - Seconds 0-59 */
+    RTC_M,                  /* 0x09 - Minutes 0-59 */
+    RTC_H,                  /* 0x0A - Hours 0-23 */
+    RTC_DL,                 /* 0x0B - Day counter bits 0-7 */
+    RTC_DH,                 /* 0x0C - Day counter bit 8, halt (0x40) and carry (0x80) */
+};
+
+#define RTC_DH_DAY          0x01
+#define RTC_DH_HALT         0x40
+#define RTC_DH_CARRY        0x80
+
+struct rtc {
+    uint8_t     regs[5];    /* Latched registers, see enum rtc_reg. */
+    uint8_t     latch;      /* Last value written to 0x6000 - 0x7FFF. */
+    uint8_t     halt;
+    uint8_t     carry;
+    int64_t     epoch;      /* CPU cycle at which the clock read zero. */
+    uint64_t    frozen;     /* Clock value (in cycles) while halted. */
+};
+
+struct mbc {
+    enum mbc_type   type;
+    int             battery;
+    int             timer;
+
+    const uint8_t   *rom;
+    uint32_t        rom_size;
+    const uint8_t   *rom0;          /* 0x0000 - 0x4000 */
+    const uint8_t   *rom1;          /* 0x4000 - 0x8000 */
+
+    uint8_t         *ram;
+    uint32_t        ram_size;
+
+    uint8_t         ram_enabled;
+    uint8_t         rom_bank;
+    uint8_t         ram_bank;       /* RAM bank or (MBC3) RTC register 0x08 - 0x0C. */
+    uint8_t         mode;           /* MBC1 banking mode. */
+
+    struct rtc      rtc;
+
+    struct cpu      *cpu;
+};
+
+void        mbc_init(struct mbc *mbc, struct cpu *cpu);
+void        mbc_cleanup(struct mbc *mbc);
+int         mbc_load(struct mbc *mbc, const struct cartridge *cartridge);
+uint8_t     mbc_rb(const struct mbc *mbc, const uint16_t addr);
+void        mbc_wb(struct mbc *mbc, const uint16_t addr, const uint8_t b);
+int         mbc_load_save(struct mbc *mbc, const char *path);
+int         mbc_save(struct mbc *mbc, const char *path);
+
+#endif
@@ -33,7 +33,7 @@ static const uint8_t boot[] = {
 static void mmu_dma_transfer(struct mmu *mmu) {
     uint16_t addr = (uint16_t)(mmu->gpu->reg_dma << 8);
     for(uint16_t i = 0; i < 0xA0; i++) {
-        mmu->gpu->oam[i] = mmu_rb(mmu, addr + i);
+        gpu_oam_wb(mmu->gpu, i, mmu_rb(mmu, addr + i));
     }
 }
 
@@ -48,23 +48,22 @@ void mmu_init(struct mmu *mmu, struct cpu *cpu, struct interrupt_controller *ic,
     mmu->timer = timer;
     mmu->input = input;
     mmu->apu = apu;
+    mbc_init(&mmu->mbc, cpu);
 }
 
 void mmu_cleanup(struct mmu *mmu) {
-    (void)mmu;
+    mbc_cleanup(&mmu->mbc);
 }
 
 uint8_t mmu_rb(const struct mmu *mmu, const uint16_t addr) {
     if(addr < 0x100 && mmu->reg_boot == 0) {
         return boot[addr];
-    } else if(addr >= 0x0000 && addr < 0x4000) {
-        return mmu->rom0[addr & 0x3FFF];
-    } else if(addr >= 0x4000 && addr < 0x8000) {
-        return mmu->rom1[addr & 0x3FFF];
+    } else if(addr >= 0x0000 && addr < 0x8000) {
+        return mbc_rb(&mmu->mbc, addr);
     } else if(addr >= 0x8000 && addr < 0xA000) {
         return mmu->gpu->vram[addr & 0x1FFF];
     } else if(addr >= 0xA000 && addr < 0xC000) {
-        return mmu->ram1[addr & 0x1FFF];
+        return mbc_rb(&mmu->mbc, addr);
     } else if(addr >= 0xC000 && addr < 0xE000) {
         return mmu->ram0[addr & 0x1FFF];
     } else if(addr >= 0xE000 && addr < 0xFE00) {
@@ -84,34 +83,19 @@ uint8_t mmu_rb(const struct mmu *mmu, const uint16_t addr) {
 
             case 0xFF0F: return interrupt_controller_io_if(mmu->ic);
 
-            case 0xFF10:
-            case 0xFF11:
-            case 0xFF12:
-            case 0xFF13:
-            case 0xFF14:
-            case 0xFF16:
-            case 0xFF17:
-            case 0xFF18:
-            case 0xFF19:
-            case 0xFF1A:
-            case 0xFF1B:
-            case 0xFF1C:
-            case 0xFF1D:
-            case 0xFF1E:
-            case 0xFF20:
-            case 0xFF21:
-            case 0xFF22:
-            case 0xFF23:
-            case 0xFF24:
-            case 0xFF25:
-            case 0xFF26:
-                return apu_rb(mmu->apu, addr);
-
+            case 0xFF10: case 0xFF11: case 0xFF12: case 0xFF13:
+            case 0xFF14: case 0xFF15: case 0xFF16: case 0xFF17:
+            case 0xFF18: case 0xFF19: case 0xFF1A: case 0xFF1B:
+            case 0xFF1C: case 0xFF1D: case 0xFF1E: case 0xFF1F:
+            case 0xFF20: case 0xFF21: case 0xFF22: case 0xFF23:
+            case 0xFF24: case 0xFF25: case 0xFF26: case 0xFF27:
+            case 0xFF28: case 0xFF29: case 0xFF2A: case 0xFF2B:
+            case 0xFF2C: case 0xFF2D: case 0xFF2E: case 0xFF2F:
             case 0xFF30: case 0xFF31: case 0xFF32: case 0xFF33:
             case 0xFF34: case 0xFF35: case 0xFF36: case 0xFF37:
             case 0xFF38: case 0xFF39: case 0xFF3A: case 0xFF3B:
             case 0xFF3C: case 0xFF3D: case 0xFF3E: case 0xFF3F:
-                return mmu->apu->wave_ram[addr & 0x0F];
+                return apu_rb(mmu->apu, addr);
 
             case 0xFF40: return gpu_io_lcdc(mmu->gpu);
             case 0xFF41: return gpu_io_stat(mmu->gpu);
@@ -144,20 +128,18 @@ void mmu_wb(struct mmu *mmu, const uint16_t addr, const uint8_t b) {
         /* boot ROM */
         fprintf(stderr, "write to boot rom!\n");
         exit(1);
-    } else if(addr >= 0x0000 && addr < 0x4000) {
-        mmu->rom0[addr & 0x3FFF] = b;
-    } else if(addr >= 0x4000 && addr < 0x8000) {
-        mmu->rom1[addr & 0x3FFF] = b;
+    } else if(addr >= 0x0000 && addr < 0x8000) {
+        mbc_wb(&mmu->mbc, addr, b);
     } else if(addr >= 0x8000 && addr < 0xA000) {
-        mmu->gpu->vram[addr & 0x1FFF] = b;
+        gpu_vram_wb(mmu->gpu, addr & 0x1FFF, b);
     } else if(addr >= 0xA000 && addr < 0xC000) {
-        mmu->ram1[addr & 0x1FFF] = b;
+        mbc_wb(&mmu->mbc, addr, b);
     } else if(addr >= 0xC000 && addr < 0xE000) {
         mmu->ram0[addr & 0x1FFF] = b;
     } else if(addr >= 0xE000 && addr < 0xFE00) {
         mmu->ram0[addr & 0x1FFF] = b;
     } else if(addr >= 0xFE00 && addr < 0xFEA0) {
-        mmu->gpu->oam[addr & 0xFF] = b;
+        gpu_oam_wb(mmu->gpu, addr & 0xFF, b);
     } else if(addr >= 0xFEA0 && addr < 0xFF00) {
         /* unusable */
     } else if(addr >= 0xFF00 && addr < 0xFF80) {
@@ -171,34 +153,19 @@ void mmu_wb(struct mmu *mmu, const uint16_t addr, const uint8_t b) {
 
             case 0xFF0F: interrupt_controller_io_set_if(mmu->ic, b); break;
 
-            case 0xFF11:
-            case 0xFF12:
-            case 0xFF13:
-            case 0xFF14:
-            case 0xFF16:
-            case 0xFF17:
-            case 0xFF18:
-            case 0xFF19:
-            case 0xFF1A:
-            case 0xFF1B:
-            case 0xFF1C:
-            case 0xFF1D:
-            case 0xFF1E:
-            case 0xFF20:
-            case 0xFF21:
-            case 0xFF22:
-            case 0xFF23:
-            case 0xFF24:
-            case 0xFF25:
-            case 0xFF26:
-                apu_wb(mmu->apu, addr, b);
-                break;
-
+            case 0xFF10: case 0xFF11: case 0xFF12: case 0xFF13:
+            case 0xFF14: case 0xFF15: case 0xFF16: case 0xFF17:
+            case 0xFF18: case 0xFF19: case 0xFF1A: case 0xFF1B:
+            case 0xFF1C: case 0xFF1D: case 0xFF1E: case 0xFF1F:
+            case 0xFF20: case 0xFF21: case 0xFF22: case 0xFF23:
+            case 0xFF24: case 0xFF25: case 0xFF26: case 0xFF27:
+            case 0xFF28: case 0xFF29: case 0xFF2A: case 0xFF2B:
+            case 0xFF2C: case 0xFF2D: case 0xFF2E: case 0xFF2F:
             case 0xFF30: case 0xFF31: case 0xFF32: case 0xFF33:
             case 0xFF34: case 0xFF35: case 0xFF36: case 0xFF37:
             case 0xFF38: case 0xFF39: case 0xFF3A: case 0xFF3B:
             case 0xFF3C: case 0xFF3D: case 0xFF3E: case 0xFF3F:
-                mmu->apu->wave_ram[addr & 0x0F] = b;
+                apu_wb(mmu->apu, addr, b);
                 break;
 
             case 0xFF40: gpu_io_set_lcdc(mmu->gpu, b); break;
@@ -235,21 +202,6 @@ void mmu_ww(struct mmu *mmu, const uint16_t addr, const uint16_t w) {
     mmu_wb(mmu, (addr + 1), (uint8_t)(w >> 8));
 }
 
-int mmu_load_rom(struct mmu *mmu, const char *path) {
-    uint8_t buf[0x8000];
-    FILE *fp = fopen(path, "rb");
-    if(fp == NULL) {
-        return -1;
-    }
-    if(fread(buf, sizeof(buf), 1, fp) != 1) {
-        fclose(fp);
-        return -1;
-    }
-    fclose(fp);
-
-    for(uint16_t i = 0; i < 0x4000; i++) {
-        mmu->rom0[i] = buf[i];
-        mmu->rom1[i] = buf[0x4000 + i];
-    }
-    return 0;
+int mmu_load_cartridge(struct mmu *mmu, const struct cartridge *cartridge) {
+    return mbc_load(&mmu->mbc, cartridge);
 }
@@ -0,0 +1,187 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "observe.h"
+#include "gpu.h"
+#include "screen.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Every output pixel covers SCREEN_WIDTH x SCREEN_HEIGHT units of overlap. */
+#define OBSERVE_AREA        (SCREEN_WIDTH * SCREEN_HEIGHT)
+#define OBSERVE_PLANE_SIZE  (OBSERVE_WIDTH * OBSERVE_HEIGHT)
+
+/*** Private ***/
+
+/*
+ *  With a source pixel dst units wide and an output pixel src units wide,
+ *  both axes span src * dst units and the overlaps are whole numbers.
+ */
+static void observe_taps(struct observe_tap *taps, const int src, const int dst) {
+    for(int o = 0; o < dst; o++) {
+        int lo = o * src;
+        int hi = (o + 1) * src;
+        struct observe_tap *t = &taps[o];
+        t->from = (uint8_t)(lo / dst);
+        t->count = 0;
+        for(int x = t->from; x * dst < hi; x++) {
+            int a = x * dst > lo ? x * dst : lo;
+            int b = (x + 1) * dst < hi ? (x + 1) * dst : hi;
+            t->weight[t->count++] = (uint8_t)(b - a);
+        }
+    }
+}
+
+/* Weighted sum of the source rows covered by output row t. At most 255 * 144, fits 16 bits. */
+static void observe_sum_rows(uint16_t *acc, const uint8_t *values, const struct observe_tap *t) {
+    const uint8_t *row = &values[t->from * SCREEN_WIDTH];
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for(int x = 0; x < SCREEN_WIDTH; x += 8) {
+        __m128i sum = zero;
+        for(int k = 0; k < t->count; k++) {
+            __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&row[k * SCREEN_WIDTH + x]), zero);
+            sum = _mm_add_epi16(sum, _mm_mullo_epi16(v, _mm_set1_epi16(t->weight[k])));
+        }
+        _mm_storeu_si128((__m128i *)&acc[x], sum);
+    }
+#else
+    for(int x = 0; x < SCREEN_WIDTH; x++) {
+        uint16_t sum = 0;
+        for(int k = 0; k < t->count; k++) {
+            sum += (uint16_t)(row[k * SCREEN_WIDTH + x] * t->weight[k]);
+        }
+        acc[x] = sum;
+    }
+#endif
+}
+
+/* Downsample one plane of 160x144 values (0-255) to out. */
+static void observe_plane(const struct observe *obs, uint8_t *out, const uint8_t *values) {
+    uint16_t acc[SCREEN_WIDTH];
+
+    for(int y = 0; y < OBSERVE_HEIGHT; y++) {
+        observe_sum_rows(acc, values, &obs->rows[y]);
+        for(int x = 0; x < OBSERVE_WIDTH; x++) {
+            const struct observe_tap *t = &obs->cols[x];
+            uint32_t sum = 0;
+            for(int k = 0; k < t->count; k++) {
+                sum += (uint32_t)acc[t->from + k] * t->weight[k];
+            }
+            out[y * OBSERVE_WIDTH + x] = (uint8_t)((sum + OBSERVE_AREA / 2) / OBSERVE_AREA);
+        }
+    }
+}
+
+static void observe_max(uint8_t *out, const uint8_t *a, const uint8_t *b, const size_t size) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for(; i + 16 <= size; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i *)&a[i]);
+        __m128i vb = _mm_loadu_si128((const __m128i *)&b[i]);
+        _mm_storeu_si128((__m128i *)&out[i], _mm_max_epu8(va, vb));
+    }
+#endif
+    for(; i < size; i++) {
+        out[i] = a[i] > b[i] ? a[i] : b[i];
+    }
+}
+
+/*** Public ***/
+
+int observe_init(struct observe *obs, enum observe_format format, int stack, int max_pool) {
+    memset(obs, 0, sizeof(struct observe));
+    if(stack < 1 || stack > OBSERVE_STACK_MAX) {
+        fprintf(stderr, "observe error: can't stack %d frames\n", stack);
+        return -1;
+    }
+
+    obs->format = format;
+    obs->planes = (format == OBSERVE_PLANES) ? 4 : 1;
+    obs->stack = stack;
+    obs->max_pool = max_pool;
+    observe_taps(obs->cols, SCREEN_WIDTH, OBSERVE_WIDTH);
+    observe_taps(obs->rows, SCREEN_HEIGHT, OBSERVE_HEIGHT);
+
+    size_t size = (size_t)obs->planes * OBSERVE_PLANE_SIZE;
+    obs->raw[0] = malloc(size);
+    obs->raw[1] = malloc(size);
+    obs->frames = calloc((size_t)stack, size);
+    if(obs->raw[0] == NULL || obs->raw[1] == NULL || obs->frames == NULL) {
+        fprintf(stderr, "observe error: out of memory\n");
+        observe_cleanup(obs);
+        return -1;
+    }
+    return 0;
+}
+
+void observe_cleanup(struct observe *obs) {
+    free(obs->raw[0]);
+    free(obs->raw[1]);
+    free(obs->frames);
+    obs->raw[0] = obs->raw[1] = obs->frames = NULL;
+}
+
+/* Bytes written by observe_frame(). */
+size_t observe_size(const struct observe *obs) {
+    return (size_t)obs->stack * obs->planes * OBSERVE_PLANE_SIZE;
+}
+
+int observe_frame(struct observe *obs, const struct gpu *gpu, uint8_t *out) {
+    if(gpu->worker != NULL) {
+        fprintf(stderr, "observe error: no lines with threaded rendering\n");
+        return -1;
+    }
+
+    size_t size = (size_t)obs->planes * OBSERVE_PLANE_SIZE;
+    uint8_t *raw = obs->raw[obs->raw_cur];
+    uint8_t values[SCREEN_HEIGHT][SCREEN_WIDTH];
+
+    /*
+     *  Palette qualified color index to plane value, with the shades each
+     *  line was shown with. The table is rebuilt only where they change.
+     */
+    for(int p = 0; p < obs->planes; p++) {
+        uint8_t lut[16];
+        const uint8_t *lut_shades = NULL;
+        for(int y = 0; y < SCREEN_HEIGHT; y++) {
+            const uint8_t *shades = gpu->line_shades[y];
+            if(lut_shades == NULL || memcmp(shades, lut_shades, sizeof(gpu->line_shades[y])) != 0) {
+                for(int i = 0; i < 16; i++) {
+                    uint8_t shade = shades[i] & 0x03;
+                    if(obs->format == OBSERVE_GRAY) {
+                        lut[i] = (uint8_t)(255 - shade * 85);
+                    } else {
+                        lut[i] = (shade == p) ? 255 : 0;
+                    }
+                }
+                lut_shades = shades;
+            }
+
+            const uint8_t *line = gpu->lines[y];
+            uint8_t *value = values[y];
+            for(int x = 0; x < SCREEN_WIDTH; x++) {
+                value[x] = lut[line[x] & 0x0F];
+            }
+        }
+        observe_plane(obs, &raw[p * OBSERVE_PLANE_SIZE], &values[0][0]);
+    }
+
+    obs->newest = (obs->newest + 1) % obs->stack;
+    uint8_t *frame = &obs->frames[obs->newest * size];
+    if(obs->max_pool && obs->raw_valid) {
+        observe_max(frame, raw, obs->raw[obs->raw_cur ^ 1], size);
+    } else {
+        memcpy(frame, raw, size);
+    }
+    obs->raw_cur ^= 1;
+    obs->raw_valid = 1;
+
+    for(int k = 0; k < obs->stack; k++) {
+        int slot = (obs->newest + 1 + k) % obs->stack;
+        memcpy(&out[k * size], &obs->frames[slot * size], size);
+    }
+    return 0;
+}
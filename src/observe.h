@@ -0,0 +1,71 @@
+/*
+ *  observe.h
+ *  =========
+ *
+ *  Downsampled observations of the screen for learning agents, built from
+ *  the composed lines of the GPU (gpu->lines) rather than the frame
+ *  buffer:
+ *
+ *      OBSERVE_GRAY    - one 84x84 plane, 0 (black) - 255 (white).
+ *      OBSERVE_PLANES  - four 84x84 planes, one per shade (0 lightest),
+ *                        each the share of the area in that shade 0 - 255.
+ *
+ *  Every output pixel is the exact area average of the 160x144 pixels it
+ *  covers. Optionally each frame is max-pooled with the frame before it
+ *  (objects flickering at 30 Hz show up in both), and the last N frames
+ *  are stacked oldest first:
+ *
+ *      out[stack][plane][84][84]
+ *
+ *  Call observe_frame() at each VBLANK, from gboy's frame_hook (see
+ *  main.c -o). The lines hold the frame just drawn, so it can not be used
+ *  with threaded rendering or on skipped frames.
+ *
+ */
+#ifndef GBOY_OBSERVE_H
+#define GBOY_OBSERVE_H
+
+#include <inttypes.h>
+#include <stddef.h>
+
+#define OBSERVE_WIDTH       84
+#define OBSERVE_HEIGHT      84
+#define OBSERVE_STACK_MAX   16
+
+struct gpu;
+
+enum observe_format {
+    OBSERVE_GRAY,
+    OBSERVE_PLANES,
+};
+
+/* Source pixels (at most 3) covered by one output pixel, with their overlap. */
+struct observe_tap {
+    uint8_t from;
+    uint8_t count;
+    uint8_t weight[3];
+};
+
+struct observe {
+    enum observe_format format;
+    int planes;
+    int stack;
+    int max_pool;
+
+    struct observe_tap cols[OBSERVE_WIDTH];
+    struct observe_tap rows[OBSERVE_HEIGHT];
+
+    uint8_t *raw[2];        /* This and the previous frame, before pooling. */
+    int raw_cur;
+    int raw_valid;          /* raw[raw_cur ^ 1] holds a frame. */
+
+    uint8_t *frames;        /* Ring of the last stack frames. */
+    int newest;
+};
+
+int     observe_init(struct observe *obs, enum observe_format format, int stack, int max_pool);
+void    observe_cleanup(struct observe *obs);
+size_t  observe_size(const struct observe *obs);
+int     observe_frame(struct observe *obs, const struct gpu *gpu, uint8_t *out);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include "pace.h"
+#include "apu.h"
+
+#define NS_PER_SEC  1000000000ULL
+
+/*** Private ***/
+
+static uint64_t pace_frames_ns(const uint64_t frames) {
+    return frames * PACE_FRAME_NS + ((frames * PACE_FRAME_NS_FRAC) >> 16);
+}
+
+static uint64_t pace_clock_now(const struct pace *pace) {
+    return (pace->clock == PACE_AUDIO) ? apu_clock(pace->apu) : pace_now();
+}
+
+static void pace_sleep_until(const uint64_t t) {
+    struct timespec ts = { .tv_sec = (time_t)(t / NS_PER_SEC), .tv_nsec = (long)(t % NS_PER_SEC) };
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+/*** Public ***/
+
+void pace_init(struct pace *pace, struct apu *apu) {
+    pace->clock = PACE_MONOTONIC;
+    pace->apu = apu;
+    pace_reset(pace);
+}
+
+int pace_set_clock(struct pace *pace, enum pace_clock clock) {
+    if(clock == PACE_AUDIO && pace->apu->dev == 0) {
+        fprintf(stderr, "pace error: no audio device to pace by\n");
+        return -1;
+    }
+    pace->clock = clock;
+    pace_reset(pace);
+    return 0;
+}
+
+/* Make now frame 0. */
+void pace_reset(struct pace *pace) {
+    pace->start = (pace->clock == PACE_OFF) ? 0 : pace_clock_now(pace);
+    pace->frames = 0;
+}
+
+void pace_frame(struct pace *pace) {
+    if(pace->clock == PACE_OFF || pace->clock == PACE_VSYNC) {
+        return;
+    }
+
+    pace->frames++;
+    uint64_t due = pace->start + pace_frames_ns(pace->frames);
+    uint64_t now = pace_clock_now(pace);
+    uint64_t lag = PACE_MAX_LAG * PACE_FRAME_NS;
+    if(now > due + lag || due > now + lag) {
+        pace_reset(pace);
+        return;
+    }
+    if(now >= due) {
+        return;
+    }
+
+    if(pace->clock == PACE_AUDIO) {
+        /* Nothing to sleep on, wait the same time on the monotonic clock. */
+        pace_sleep_until(pace_now() + (due - now));
+    } else {
+        pace_sleep_until(due);
+    }
+}
+
+/* CLOCK_MONOTONIC in ns. */
+uint64_t pace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
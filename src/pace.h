@@ -0,0 +1,66 @@
+/*
+ *  pace.h
+ *  ======
+ *
+ *  Keeps the emulation at the speed of the real Game Boy. The CPU runs at
+ *  4194304 Hz and one LCD frame is 154 lines of 456 cycles, 70224 cycles,
+ *  so a frame takes 16742706.3 ns (59.73 FPS).
+ *
+ *  pace_frame() is called once per emulated frame and waits until the
+ *  next one is due. The clock frames are timed against:
+ *
+ *      PACE_MONOTONIC  - CLOCK_MONOTONIC, sleeping with clock_nanosleep()
+ *                        until an absolute deadline. Deadlines count from
+ *                        the first frame in exact nanoseconds, so a late
+ *                        wake up shortens the next wait instead of adding
+ *                        up (no drift).
+ *      PACE_AUDIO      - the audio device: frames are timed by the samples
+ *                        it has played, so emulation and sound can not
+ *                        drift apart however far the sound card's crystal
+ *                        is off.
+ *      PACE_VSYNC      - the display: every frame is presented with vsync
+ *                        and presenting blocks. Runs at the refresh rate.
+ *      PACE_OFF        - no waiting, as fast as possible.
+ *
+ *  When the emulation falls more than PACE_MAX_LAG frames behind (a slow
+ *  frame, the window being dragged) the clock starts over from now rather
+ *  than running fast to catch up.
+ *
+ */
+#ifndef GBOY_PACE_H
+#define GBOY_PACE_H
+
+#include <inttypes.h>
+
+#define PACE_CYCLES_PER_SEC     4194304
+#define PACE_CYCLES_PER_FRAME   70224
+
+/* Nanoseconds per frame, 16742706 + 19584 / 65536 exactly. */
+#define PACE_FRAME_NS           16742706ULL
+#define PACE_FRAME_NS_FRAC      19584ULL
+
+#define PACE_MAX_LAG            4
+
+struct apu;
+
+enum pace_clock {
+    PACE_MONOTONIC,
+    PACE_AUDIO,
+    PACE_VSYNC,
+    PACE_OFF,
+};
+
+struct pace {
+    enum pace_clock clock;
+    struct apu *apu;        /* Audio clock for PACE_AUDIO. */
+    uint64_t start;         /* Clock time of frame 0, ns. */
+    uint64_t frames;        /* Frames since start. */
+};
+
+void        pace_init(struct pace *pace, struct apu *apu);
+int         pace_set_clock(struct pace *pace, enum pace_clock clock);
+void        pace_reset(struct pace *pace);
+void        pace_frame(struct pace *pace);
+uint64_t    pace_now(void);
+
+#endif
@@ -0,0 +1,305 @@
+#include <string.h>
+#include "pixel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXEL_X86 1
+#include <immintrin.h>
+#endif
+
+/*** Private ***/
+
+/* The 4 shades, lightest first. */
+static const uint32_t PIXEL_GRAYS[4] = { 0xFFFFFFFF, 0xFFC0C0C0, 0xFF606060, 0xFF000000 };
+
+/*
+ *  Spread the 8 bits of b to one byte each, most significant bit first
+ *  (byte 0 in memory is bit 7, i.e. pixel 0 of a tile row).
+ */
+static uint64_t spread_bits(const uint8_t b) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    uint64_t x = (b * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+#else
+    uint64_t x = (b * 0x0101010101010101ULL) & 0x0102040810204080ULL;
+#endif
+    return ((x + 0x7F7F7F7F7F7F7F7FULL) >> 7) & 0x0101010101010101ULL;
+}
+
+static void decode_scalar(uint8_t *out, uint8_t *out_flip, const uint8_t *planes, int rows) {
+    for(int i = 0; i < rows; i++) {
+        uint64_t row = spread_bits(planes[i * 2]) | spread_bits(planes[i * 2 + 1]) << 1;
+        uint64_t flip = __builtin_bswap64(row);
+        memcpy(&out[i * 8], &row, 8);
+        memcpy(&out_flip[i * 8], &flip, 8);
+    }
+}
+
+static void map_scalar(pixel_t *out, const uint8_t *line, const uint8_t *shades, const pixel_t *colors,
+        int n) {
+#if PIXEL_FORMAT == PIXEL_FORMAT_I2
+    for(int i = 0; i < n; i += 4) {
+        out[i >> 2] = (pixel_t)(colors[shades[line[i] & 0x0F] & 0x03] << 6 |
+            colors[shades[line[i + 1] & 0x0F] & 0x03] << 4 |
+            colors[shades[line[i + 2] & 0x0F] & 0x03] << 2 |
+            colors[shades[line[i + 3] & 0x0F] & 0x03]);
+    }
+#else
+    for(int i = 0; i < n; i++) {
+        out[i] = colors[shades[line[i] & 0x0F] & 0x03];
+    }
+#endif
+}
+
+#ifdef PIXEL_X86
+
+/* Bit of each pixel in a row, for two rows. */
+#define DECODE_BITS     (char)0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
+
+/* Broadcast the lo (o = 0) or hi (o = 1) plane of rows r and r + 1 to 8 bytes each. */
+#define DECODE_PICK(r, o) \
+    (char)((r) * 2 + (o)), (char)((r) * 2 + (o)), (char)((r) * 2 + (o)), (char)((r) * 2 + (o)), \
+    (char)((r) * 2 + (o)), (char)((r) * 2 + (o)), (char)((r) * 2 + (o)), (char)((r) * 2 + (o)), \
+    (char)((r) * 2 + 2 + (o)), (char)((r) * 2 + 2 + (o)), (char)((r) * 2 + 2 + (o)), \
+    (char)((r) * 2 + 2 + (o)), (char)((r) * 2 + 2 + (o)), (char)((r) * 2 + 2 + (o)), \
+    (char)((r) * 2 + 2 + (o)), (char)((r) * 2 + 2 + (o))
+
+__attribute__((target("ssse3")))
+static __m128i decode_pair_ssse3(const __m128i planes, const __m128i pick_lo, const __m128i pick_hi) {
+    const __m128i bits = _mm_setr_epi8(DECODE_BITS, DECODE_BITS);
+    __m128i lo = _mm_shuffle_epi8(planes, pick_lo);
+    __m128i hi = _mm_shuffle_epi8(planes, pick_hi);
+    lo = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(lo, bits), bits), _mm_set1_epi8(1));
+    hi = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(hi, bits), bits), _mm_set1_epi8(2));
+    return _mm_or_si128(lo, hi);
+}
+
+/* 8 rows (16 plane bytes) per iteration, 2 rows per vector. */
+__attribute__((target("ssse3")))
+static void decode_ssse3(uint8_t *out, uint8_t *out_flip, const uint8_t *planes, int rows) {
+    const __m128i flip = _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m128i pick[4][2] = {
+        { _mm_setr_epi8(DECODE_PICK(0, 0)), _mm_setr_epi8(DECODE_PICK(0, 1)) },
+        { _mm_setr_epi8(DECODE_PICK(2, 0)), _mm_setr_epi8(DECODE_PICK(2, 1)) },
+        { _mm_setr_epi8(DECODE_PICK(4, 0)), _mm_setr_epi8(DECODE_PICK(4, 1)) },
+        { _mm_setr_epi8(DECODE_PICK(6, 0)), _mm_setr_epi8(DECODE_PICK(6, 1)) },
+    };
+
+    int i = 0;
+    for(; i + 8 <= rows; i += 8) {
+        __m128i p = _mm_loadu_si128((const __m128i *)&planes[i * 2]);
+        for(int k = 0; k < 4; k++) {
+            __m128i v = decode_pair_ssse3(p, pick[k][0], pick[k][1]);
+            _mm_storeu_si128((__m128i *)&out[(i + k * 2) * 8], v);
+            _mm_storeu_si128((__m128i *)&out_flip[(i + k * 2) * 8], _mm_shuffle_epi8(v, flip));
+        }
+    }
+
+    decode_scalar(&out[i * 8], &out_flip[i * 8], &planes[i * 2], rows - i);
+}
+
+/* 16 rows (32 plane bytes) per iteration; each 128-bit lane holds 8 rows. */
+__attribute__((target("avx2")))
+static void decode_avx2(uint8_t *out, uint8_t *out_flip, const uint8_t *planes, int rows) {
+    const __m256i bits = _mm256_setr_epi8(DECODE_BITS, DECODE_BITS, DECODE_BITS, DECODE_BITS);
+    const __m256i flip = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    const __m256i pick[4][2] = {
+        { _mm256_setr_epi8(DECODE_PICK(0, 0), DECODE_PICK(0, 0)),
+          _mm256_setr_epi8(DECODE_PICK(0, 1), DECODE_PICK(0, 1)) },
+        { _mm256_setr_epi8(DECODE_PICK(2, 0), DECODE_PICK(2, 0)),
+          _mm256_setr_epi8(DECODE_PICK(2, 1), DECODE_PICK(2, 1)) },
+        { _mm256_setr_epi8(DECODE_PICK(4, 0), DECODE_PICK(4, 0)),
+          _mm256_setr_epi8(DECODE_PICK(4, 1), DECODE_PICK(4, 1)) },
+        { _mm256_setr_epi8(DECODE_PICK(6, 0), DECODE_PICK(6, 0)),
+          _mm256_setr_epi8(DECODE_PICK(6, 1), DECODE_PICK(6, 1)) },
+    };
+
+    int i = 0;
+    for(; i + 16 <= rows; i += 16) {
+        __m256i p = _mm256_loadu_si256((const __m256i *)&planes[i * 2]);
+        for(int k = 0; k < 4; k++) {
+            __m256i lo = _mm256_shuffle_epi8(p, pick[k][0]);
+            __m256i hi = _mm256_shuffle_epi8(p, pick[k][1]);
+            lo = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lo, bits), bits), _mm256_set1_epi8(1));
+            hi = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(hi, bits), bits), _mm256_set1_epi8(2));
+            __m256i v = _mm256_or_si256(lo, hi);
+            __m256i f = _mm256_shuffle_epi8(v, flip);
+
+            /* Lane 0 holds rows i + 2k, lane 1 rows i + 8 + 2k. */
+            _mm_storeu_si128((__m128i *)&out[(i + k * 2) * 8], _mm256_castsi256_si128(v));
+            _mm_storeu_si128((__m128i *)&out[(i + 8 + k * 2) * 8], _mm256_extracti128_si256(v, 1));
+            _mm_storeu_si128((__m128i *)&out_flip[(i + k * 2) * 8], _mm256_castsi256_si128(f));
+            _mm_storeu_si128((__m128i *)&out_flip[(i + 8 + k * 2) * 8], _mm256_extracti128_si256(f, 1));
+        }
+    }
+
+    decode_ssse3(&out[i * 8], &out_flip[i * 8], &planes[i * 2], rows - i);
+}
+
+#if PIXEL_FORMAT == PIXEL_FORMAT_RGBA8888
+
+/*
+ *  16 pixels per iteration. The shades are looked up with one pshufb, then
+ *  every shade is widened to the 4 byte offsets of its color and a second
+ *  pshufb fetches the pixel bytes from the color table.
+ */
+__attribute__((target("ssse3")))
+static void map_ssse3(pixel_t *out, const uint8_t *line, const uint8_t *shades, const pixel_t *colors,
+        int n) {
+    const __m128i shade_table = _mm_and_si128(_mm_loadu_si128((const __m128i *)shades), _mm_set1_epi8(0x03));
+    const __m128i color_table = _mm_loadu_si128((const __m128i *)colors);
+    const __m128i bytes = _mm_setr_epi8(0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3);
+    const __m128i widen[4] = {
+        _mm_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3),
+        _mm_setr_epi8(4, 4, 4, 4, 5, 5, 5, 5, 6, 6, 6, 6, 7, 7, 7, 7),
+        _mm_setr_epi8(8, 8, 8, 8, 9, 9, 9, 9, 10, 10, 10, 10, 11, 11, 11, 11),
+        _mm_setr_epi8(12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15, 15),
+    };
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)&line[i]), _mm_set1_epi8(0x0F));
+        __m128i s = _mm_shuffle_epi8(shade_table, idx);
+        for(int k = 0; k < 4; k++) {
+            /* Shades are at most 3, so shifting 16-bit lanes can not carry. */
+            __m128i ctrl = _mm_or_si128(_mm_slli_epi16(_mm_shuffle_epi8(s, widen[k]), 2), bytes);
+            _mm_storeu_si128((__m128i *)&out[i + k * 4], _mm_shuffle_epi8(color_table, ctrl));
+        }
+    }
+
+    map_scalar(&out[i], &line[i], shades, colors, n - i);
+}
+
+/* 32 pixels per iteration, the color lookup done with vpermd. */
+__attribute__((target("avx2")))
+static void map_avx2(pixel_t *out, const uint8_t *line, const uint8_t *shades, const pixel_t *colors,
+        int n) {
+    const __m128i shade_table = _mm_and_si128(_mm_loadu_si128((const __m128i *)shades), _mm_set1_epi8(0x03));
+    const __m256i color_table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)colors));
+
+    int i = 0;
+    for(; i + 32 <= n; i += 32) {
+        for(int h = 0; h < 2; h++) {
+            __m128i idx = _mm_loadu_si128((const __m128i *)&line[i + h * 16]);
+            __m128i s = _mm_shuffle_epi8(shade_table, _mm_and_si128(idx, _mm_set1_epi8(0x0F)));
+            __m256i lo = _mm256_permutevar8x32_epi32(color_table, _mm256_cvtepu8_epi32(s));
+            __m256i hi = _mm256_permutevar8x32_epi32(color_table, _mm256_cvtepu8_epi32(_mm_srli_si128(s, 8)));
+            _mm256_storeu_si256((__m256i *)&out[i + h * 16], lo);
+            _mm256_storeu_si256((__m256i *)&out[i + h * 16 + 8], hi);
+        }
+    }
+
+    map_ssse3(&out[i], &line[i], shades, colors, n - i);
+}
+
+#elif PIXEL_FORMAT == PIXEL_FORMAT_RGB565
+
+/* 16 pixels per iteration, the low and high bytes of the colors looked up separately. */
+__attribute__((target("ssse3")))
+static void map_ssse3(pixel_t *out, const uint8_t *line, const uint8_t *shades, const pixel_t *colors,
+        int n) {
+    const __m128i shade_table = _mm_and_si128(_mm_loadu_si128((const __m128i *)shades), _mm_set1_epi8(0x03));
+    const __m128i color_table = _mm_loadl_epi64((const __m128i *)colors);
+    const __m128i lo_table = _mm_shuffle_epi8(_mm_shuffle_epi8(color_table,
+        _mm_setr_epi8(0, 2, 4, 6, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)), shade_table);
+    const __m128i hi_table = _mm_shuffle_epi8(_mm_shuffle_epi8(color_table,
+        _mm_setr_epi8(1, 3, 5, 7, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)), shade_table);
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)&line[i]), _mm_set1_epi8(0x0F));
+        __m128i lo = _mm_shuffle_epi8(lo_table, idx);
+        __m128i hi = _mm_shuffle_epi8(hi_table, idx);
+        _mm_storeu_si128((__m128i *)&out[i], _mm_unpacklo_epi8(lo, hi));
+        _mm_storeu_si128((__m128i *)&out[i + 8], _mm_unpackhi_epi8(lo, hi));
+    }
+
+    map_scalar(&out[i], &line[i], shades, colors, n - i);
+}
+
+#else
+
+/*
+ *  16 pixels per iteration, shades and colors folded into one pshufb table.
+ *  PIXEL_FORMAT_I2 then packs the 2 bit pixels 4 to a byte with two
+ *  multiply-adds (weights 64, 16, 4, 1).
+ */
+__attribute__((target("ssse3")))
+static void map_ssse3(pixel_t *out, const uint8_t *line, const uint8_t *shades, const pixel_t *colors,
+        int n) {
+    const __m128i shade_table = _mm_and_si128(_mm_loadu_si128((const __m128i *)shades), _mm_set1_epi8(0x03));
+    uint32_t packed;
+    memcpy(&packed, colors, sizeof(packed));
+    const __m128i table = _mm_shuffle_epi8(_mm_cvtsi32_si128((int)packed), shade_table);
+
+    int i = 0;
+    for(; i + 16 <= n; i += 16) {
+        __m128i idx = _mm_and_si128(_mm_loadu_si128((const __m128i *)&line[i]), _mm_set1_epi8(0x0F));
+        __m128i v = _mm_shuffle_epi8(table, idx);
+#if PIXEL_FORMAT == PIXEL_FORMAT_I2
+        v = _mm_maddubs_epi16(v, _mm_setr_epi8(64, 16, 4, 1, 64, 16, 4, 1, 64, 16, 4, 1, 64, 16, 4, 1));
+        v = _mm_madd_epi16(v, _mm_set1_epi16(1));
+        v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+        uint32_t bytes = (uint32_t)_mm_cvtsi128_si32(v);
+        memcpy(&out[i >> 2], &bytes, sizeof(bytes));
+#else
+        _mm_storeu_si128((__m128i *)&out[i], v);
+#endif
+    }
+
+    map_scalar(&out[PIXEL_OFFSET(i)], &line[i], shades, colors, n - i);
+}
+
+#endif
+
+static const struct pixel_kernels PIXEL_KERNELS_SSSE3 = { "ssse3", decode_ssse3, map_ssse3 };
+#if PIXEL_FORMAT == PIXEL_FORMAT_RGBA8888
+static const struct pixel_kernels PIXEL_KERNELS_AVX2 = { "avx2", decode_avx2, map_avx2 };
+#else
+static const struct pixel_kernels PIXEL_KERNELS_AVX2 = { "avx2", decode_avx2, map_ssse3 };
+#endif
+
+#endif
+
+/*** Public ***/
+
+const struct pixel_kernels PIXEL_KERNELS_SCALAR = { "scalar", decode_scalar, map_scalar };
+
+const struct pixel_kernels *pixel_kernels_best(void) {
+#ifdef PIXEL_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        return &PIXEL_KERNELS_AVX2;
+    }
+    if(__builtin_cpu_supports("ssse3")) {
+        return &PIXEL_KERNELS_SSSE3;
+    }
+#endif
+    return &PIXEL_KERNELS_SCALAR;
+}
+
+pixel_t pixel_shade(const uint8_t shade) {
+#if PIXEL_FORMAT == PIXEL_FORMAT_I2 || PIXEL_FORMAT == PIXEL_FORMAT_I8
+    return shade & 0x03;
+#elif PIXEL_FORMAT == PIXEL_FORMAT_RGB565
+    uint32_t argb = PIXEL_GRAYS[shade & 0x03];
+    return (pixel_t)((argb >> 8 & 0xF800) | (argb >> 5 & 0x07E0) | (argb >> 3 & 0x001F));
+#else
+    return PIXEL_GRAYS[shade & 0x03];
+#endif
+}
+
+/* Pixel i of frame as 0xAARRGGBB. */
+uint32_t pixel_argb(const pixel_t *frame, const int i) {
+#if PIXEL_FORMAT == PIXEL_FORMAT_I2
+    return PIXEL_GRAYS[(frame[i >> 2] >> (6 - (i & 0x03) * 2)) & 0x03];
+#elif PIXEL_FORMAT == PIXEL_FORMAT_I8
+    return PIXEL_GRAYS[frame[i] & 0x03];
+#elif PIXEL_FORMAT == PIXEL_FORMAT_RGB565
+    uint32_t r = (frame[i] >> 11) & 0x1F;
+    uint32_t g = (frame[i] >> 5) & 0x3F;
+    uint32_t b = frame[i] & 0x1F;
+    return 0xFF000000 | (r << 3 | r >> 2) << 16 | (g << 2 | g >> 4) << 8 | (b << 3 | b >> 2);
+#else
+    return frame[i];
+#endif
+}
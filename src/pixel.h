@@ -0,0 +1,94 @@
+/*
+ *  pixel.h
+ *  =======
+ *
+ *  Pixel kernels used by the GPU, with vectorised versions selected at
+ *  runtime depending on what the host CPU supports.
+ *
+ *      decode  - Turn rows of 2bpp tile data (lo, hi bitplane pairs) into
+ *                one color index (0-3) per byte, and the same rows
+ *                horizontally flipped.
+ *
+ *      map     - Turn a line of palette qualified color indices (0-15) into
+ *                screen pixels, through a 16 entry shade table (palette
+ *                registers) and a 4 entry color table (shade to pixel).
+ *
+ *  The scalar kernels are always available and produce bit-identical
+ *  output to the SSSE3 (pshufb) and AVX2 ones.
+ *
+ *  Pixel formats
+ *  -------------
+ *
+ *  The frame buffer format is chosen at compile time with PIXEL_FORMAT
+ *  (make FORMAT=RGB565), and the map kernels are built for that format
+ *  only:
+ *
+ *      PIXEL_FORMAT_I2         - shades 0-3, 4 pixels per byte, leftmost
+ *                                pixel in the top bits.
+ *      PIXEL_FORMAT_I8         - shades 0-3, one per byte.
+ *      PIXEL_FORMAT_RGB565     - 16 bit RGB.
+ *      PIXEL_FORMAT_RGBA8888   - 0xAARRGGBB (default).
+ *
+ *  A frame is an array of pixel_t; use PIXEL_OFFSET() to find pixel i in
+ *  it and pixel_put() to write a single pixel.
+ *
+ */
+#ifndef GBOY_PIXEL_H
+#define GBOY_PIXEL_H
+
+#include <inttypes.h>
+
+#define PIXEL_FORMAT_I2         0
+#define PIXEL_FORMAT_I8         1
+#define PIXEL_FORMAT_RGB565     2
+#define PIXEL_FORMAT_RGBA8888   3
+
+#ifndef PIXEL_FORMAT
+#define PIXEL_FORMAT            PIXEL_FORMAT_RGBA8888
+#endif
+
+#if PIXEL_FORMAT == PIXEL_FORMAT_I2
+#define PIXEL_BITS              2
+typedef uint8_t pixel_t;
+#elif PIXEL_FORMAT == PIXEL_FORMAT_I8
+#define PIXEL_BITS              8
+typedef uint8_t pixel_t;
+#elif PIXEL_FORMAT == PIXEL_FORMAT_RGB565
+#define PIXEL_BITS              16
+typedef uint16_t pixel_t;
+#elif PIXEL_FORMAT == PIXEL_FORMAT_RGBA8888
+#define PIXEL_BITS              32
+typedef uint32_t pixel_t;
+#else
+#error "Unknown PIXEL_FORMAT"
+#endif
+
+/* Index of the pixel_t holding pixel i (i a multiple of 4 for PIXEL_FORMAT_I2). */
+#define PIXEL_OFFSET(i)         ((i) * PIXEL_BITS / 8 / (int)sizeof(pixel_t))
+
+/*
+ *  map writes n pixels from the start of out, n is a multiple of 4. colors
+ *  holds the pixel value of each of the 4 shades.
+ */
+struct pixel_kernels {
+    const char *name;
+    void (*decode)(uint8_t *out, uint8_t *out_flip, const uint8_t *planes, int rows);
+    void (*map)(pixel_t *out, const uint8_t *line, const uint8_t *shades, const pixel_t *colors, int n);
+};
+
+extern const struct pixel_kernels PIXEL_KERNELS_SCALAR;
+
+const struct pixel_kernels *pixel_kernels_best(void);
+pixel_t pixel_shade(const uint8_t shade);
+uint32_t pixel_argb(const pixel_t *frame, const int i);
+
+static inline void pixel_put(pixel_t *frame, const int i, const pixel_t color) {
+#if PIXEL_FORMAT == PIXEL_FORMAT_I2
+    int shift = 6 - (i & 0x03) * 2;
+    frame[i >> 2] = (pixel_t)((frame[i >> 2] & ~(0x03 << shift)) | color << shift);
+#else
+    frame[i] = color;
+#endif
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "ring.h"
+
+/*** Private ***/
+
+/* Copy n samples between the ring at position pos and flat memory, in at most two parts. */
+static void ring_copy_in(struct ring *ring, const uint32_t pos, const float *in, const uint32_t n) {
+    uint32_t at = pos & (ring->size - 1);
+    uint32_t first = (ring->size - at < n) ? ring->size - at : n;
+    memcpy(&ring->buf[at], in, first * sizeof(float));
+    memcpy(ring->buf, &in[first], (n - first) * sizeof(float));
+}
+
+static void ring_copy_out(const struct ring *ring, const uint32_t pos, float *out, const uint32_t n) {
+    uint32_t at = pos & (ring->size - 1);
+    uint32_t first = (ring->size - at < n) ? ring->size - at : n;
+    memcpy(out, &ring->buf[at], first * sizeof(float));
+    memcpy(&out[first], ring->buf, (n - first) * sizeof(float));
+}
+
+/*** Public ***/
+
+int ring_init(struct ring *ring, const uint32_t size) {
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->buf = calloc(size, sizeof(float));
+    if(ring->buf == NULL) {
+        fprintf(stderr, "ring error: out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+void ring_cleanup(struct ring *ring) {
+    free(ring->buf);
+    ring->buf = NULL;
+}
+
+/* Producer side. */
+uint32_t ring_write(struct ring *ring, const float *in, const uint32_t n) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t room = ring->size - (tail - head);
+    uint32_t count = n < room ? n : room;
+    ring_copy_in(ring, tail, in, count);
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
+}
+
+/* Consumer side. */
+uint32_t ring_read(struct ring *ring, float *out, const uint32_t n) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint32_t count = (tail - head) < n ? tail - head : n;
+    ring_copy_out(ring, head, out, count);
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+/* Samples waiting, a snapshot from either side. */
+uint32_t ring_fill(struct ring *ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head;
+}
@@ -0,0 +1,35 @@
+/*
+ *  ring.h
+ *  ======
+ *
+ *  A lock-free ring of samples between one producer thread and one
+ *  consumer thread. No locks and no waiting: ring_write() writes what
+ *  fits and ring_read() reads what is there, both return how many.
+ *
+ *  head and tail count the samples read and written since the start and
+ *  only grow (wrapping at 2^32), so a sample's position is its time in
+ *  samples. The producer only stores tail and the consumer only head,
+ *  with release/acquire ordering so the samples are visible before the
+ *  position that publishes them.
+ *
+ */
+#ifndef GBOY_RING_H
+#define GBOY_RING_H
+
+#include <inttypes.h>
+#include <stdatomic.h>
+
+struct ring {
+    float *buf;
+    uint32_t size;          /* A power of 2. */
+    atomic_uint head;       /* Samples read. */
+    atomic_uint tail;       /* Samples written. */
+};
+
+int         ring_init(struct ring *ring, const uint32_t size);
+void        ring_cleanup(struct ring *ring);
+uint32_t    ring_write(struct ring *ring, const float *in, const uint32_t n);
+uint32_t    ring_read(struct ring *ring, float *out, const uint32_t n);
+uint32_t    ring_fill(struct ring *ring);
+
+#endif
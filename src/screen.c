@@ -1,22 +1,305 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include "screen.h"
 
+#if PIXEL_FORMAT == PIXEL_FORMAT_RGB565
+#define SCREEN_TEXTURE_FORMAT   SDL_PIXELFORMAT_RGB565
+#else
+#define SCREEN_TEXTURE_FORMAT   SDL_PIXELFORMAT_ARGB8888
+#endif
+
+#define SCREEN_SCALE            4   /* Initial window size. */
+
+/* Frame copy for the filters, with FILTER_PAD pixels of border. */
+#define SCREEN_PAD_WIDTH        (SCREEN_WIDTH + 2 * FILTER_PAD)
+#define SCREEN_PAD_HEIGHT       (SCREEN_HEIGHT + 2 * FILTER_PAD)
+
+/*** Private ***/
+
+/* The largest whole multiple of the texture that fits the window, centered. */
+static SDL_Rect screen_viewport(struct screen *screen) {
+    SDL_Rect rect = { 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT };
+    int w, h;
+    if(SDL_GetRendererOutputSize(screen->renderer, &w, &h) != 0) {
+        return rect;
+    }
+
+    /* Filtered frames that don't fit are scaled down to a multiple of the screen instead. */
+    int tw = SCREEN_WIDTH * screen->filter->scale;
+    int th = SCREEN_HEIGHT * screen->filter->scale;
+    if(w < tw || h < th) {
+        tw = SCREEN_WIDTH;
+        th = SCREEN_HEIGHT;
+    }
+
+    int scale = w / tw < h / th ? w / tw : h / th;
+    if(scale < 1) {
+        rect.w = w;
+        rect.h = h;
+        return rect;
+    }
+    rect.w = tw * scale;
+    rect.h = th * scale;
+    rect.x = (w - rect.w) / 2;
+    rect.y = (h - rect.h) / 2;
+    return rect;
+}
+
+static void screen_present(struct screen *screen) {
+    SDL_Rect viewport = screen_viewport(screen);
+    SDL_SetRenderDrawColor(screen->renderer, 0, 0, 0, 255);
+    SDL_RenderClear(screen->renderer);
+    SDL_RenderCopy(screen->renderer, screen->texture, NULL, &viewport);
+    SDL_RenderPresent(screen->renderer);
+}
+
+/* Copy the frame into the texture as it is, the renderer does the scaling. */
+static void screen_upload(struct screen *screen) {
+    void *pixels;
+    int pitch;
+    if(SDL_LockTexture(screen->texture, NULL, &pixels, &pitch) != 0) {
+        return;
+    }
+
+    /* The texture pitch may be wider than a line. */
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        uint8_t *row = (uint8_t *)pixels + y * pitch;
+#if PIXEL_FORMAT == PIXEL_FORMAT_RGBA8888 || PIXEL_FORMAT == PIXEL_FORMAT_RGB565
+        memcpy(row, &screen->back_buffer[y * SCREEN_WIDTH], SCREEN_WIDTH * sizeof(pixel_t));
+#else
+        uint32_t *out = (uint32_t *)row;
+        for(int x = 0; x < SCREEN_WIDTH; x++) {
+            out[x] = pixel_argb(screen->back_buffer, y * SCREEN_WIDTH + x);
+        }
+#endif
+    }
+    SDL_UnlockTexture(screen->texture);
+}
+
+/* Copy the frame to filter_in as 0xAARRGGBB, repeating the edge pixels into the border. */
+static void screen_filter_input(struct screen *screen) {
+    uint32_t *in = screen->filter_in;
+
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        uint32_t *row = &in[(FILTER_PAD + y) * SCREEN_PAD_WIDTH];
+#if PIXEL_FORMAT == PIXEL_FORMAT_RGBA8888
+        memcpy(&row[FILTER_PAD], &screen->back_buffer[y * SCREEN_WIDTH], SCREEN_WIDTH * sizeof(uint32_t));
+#else
+        for(int x = 0; x < SCREEN_WIDTH; x++) {
+            row[FILTER_PAD + x] = pixel_argb(screen->back_buffer, y * SCREEN_WIDTH + x);
+        }
+#endif
+        for(int x = 0; x < FILTER_PAD; x++) {
+            row[x] = row[FILTER_PAD];
+            row[FILTER_PAD + SCREEN_WIDTH + x] = row[FILTER_PAD + SCREEN_WIDTH - 1];
+        }
+    }
+
+    size_t size = SCREEN_PAD_WIDTH * sizeof(uint32_t);
+    for(int y = 0; y < FILTER_PAD; y++) {
+        memcpy(&in[y * SCREEN_PAD_WIDTH], &in[FILTER_PAD * SCREEN_PAD_WIDTH], size);
+        memcpy(&in[(FILTER_PAD + SCREEN_HEIGHT + y) * SCREEN_PAD_WIDTH],
+            &in[(FILTER_PAD + SCREEN_HEIGHT - 1) * SCREEN_PAD_WIDTH], size);
+    }
+}
+
+static void screen_filter_show(struct screen *screen) {
+    int pitch = SCREEN_WIDTH * screen->filter->scale * (int)sizeof(uint32_t);
+    SDL_UpdateTexture(screen->texture, NULL, screen->filter_out, pitch);
+    screen_present(screen);
+}
+
+static int screen_filter_run(void *data) {
+    struct screen *screen = data;
+    for(;;) {
+        SDL_SemWait(screen->filter_ready);
+        if(screen->filter_quit) {
+            return 0;
+        }
+        screen->filter->run(screen->filter_out, &screen->filter_in[FILTER_PAD * SCREEN_PAD_WIDTH + FILTER_PAD],
+            SCREEN_PAD_WIDTH);
+        SDL_SemPost(screen->filter_done);
+    }
+}
+
+static int screen_filter_start(struct screen *screen) {
+    screen->filter_in = calloc(SCREEN_PAD_WIDTH * SCREEN_PAD_HEIGHT, sizeof(uint32_t));
+    screen->filter_out = calloc(SCREEN_WIDTH * SCREEN_HEIGHT * FILTER_SCALE_MAX * FILTER_SCALE_MAX,
+        sizeof(uint32_t));
+    screen->filter_ready = SDL_CreateSemaphore(0);
+    screen->filter_done = SDL_CreateSemaphore(0);
+    screen->filter_quit = 0;
+    if(screen->filter_in == NULL || screen->filter_out == NULL || screen->filter_ready == NULL ||
+            screen->filter_done == NULL) {
+        fprintf(stderr, "screen error: failed to set up the filter thread\n");
+        return -1;
+    }
+
+    screen->filter_thread = SDL_CreateThread(screen_filter_run, "filter", screen);
+    if(screen->filter_thread == NULL) {
+        fprintf(stderr, "screen error: failed to start the filter thread: %s\n", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ *  Hand back_buffer to the filter thread, showing the frame it has been
+ *  working on. Returns 1 if that was presented.
+ */
+static int screen_filter_submit(struct screen *screen) {
+    int presented = screen->filter_busy;
+    if(screen->filter_busy) {
+        SDL_SemWait(screen->filter_done);
+        screen_filter_show(screen);
+    }
+    screen_filter_input(screen);
+    screen->filter_busy = 1;
+    SDL_SemPost(screen->filter_ready);
+    return presented;
+}
+
+static void screen_filter_stop(struct screen *screen) {
+    if(screen->filter_thread != NULL) {
+        if(screen->filter_busy) {
+            SDL_SemWait(screen->filter_done);
+            screen->filter_busy = 0;
+        }
+        screen->filter_quit = 1;
+        SDL_SemPost(screen->filter_ready);
+        SDL_WaitThread(screen->filter_thread, NULL);
+        screen->filter_thread = NULL;
+    }
+    if(screen->filter_ready != NULL) {
+        SDL_DestroySemaphore(screen->filter_ready);
+    }
+    if(screen->filter_done != NULL) {
+        SDL_DestroySemaphore(screen->filter_done);
+    }
+    free(screen->filter_in);
+    free(screen->filter_out);
+    screen->filter_ready = screen->filter_done = NULL;
+    screen->filter_in = screen->filter_out = NULL;
+}
+
+/*** Public ***/
+
 void screen_init(struct screen *screen) {
+    memset(screen, 0, sizeof(struct screen));
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
     screen->window = SDL_CreateWindow("gboy", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-        800, 600, SDL_WINDOW_SHOWN);
-    screen->screen = SDL_GetWindowSurface(screen->window);
-    screen->buffer = SDL_CreateRGBSurface(0, SCREEN_WIDTH, SCREEN_HEIGHT, 32, 0, 0, 0, 0);
-    memset(screen->back_buffer, 0xFF, sizeof(screen->back_buffer));
+        SCREEN_WIDTH * SCREEN_SCALE, SCREEN_HEIGHT * SCREEN_SCALE, SDL_WINDOW_SHOWN | SDL_WINDOW_RESIZABLE);
+    screen->renderer = SDL_CreateRenderer(screen->window, -1, SDL_RENDERER_ACCELERATED);
+    if(screen->renderer == NULL) {
+        screen->renderer = SDL_CreateRenderer(screen->window, -1, 0);
+    }
+    if(screen->renderer == NULL) {
+        fprintf(stderr, "screen error: failed to create renderer: %s\n", SDL_GetError());
+    }
+    for(int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+        pixel_put(screen->back_buffer, i, pixel_shade(0));
+    }
+    screen_set_filter(screen, &FILTERS[0]);
 }
 
 void screen_cleanup(struct screen *screen) {
-    SDL_FreeSurface(screen->buffer);
+    screen_filter_stop(screen);
+    SDL_DestroyTexture(screen->texture);
+    SDL_DestroyRenderer(screen->renderer);
     SDL_DestroyWindow(screen->window);
 }
 
-void screen_update(struct screen *screen) {
-    SDL_LockSurface(screen->buffer);
-    memcpy(screen->buffer->pixels, screen->back_buffer, sizeof(screen->back_buffer));
-    SDL_UnlockSurface(screen->buffer);
-    SDL_BlitScaled(screen->buffer, NULL, screen->screen, NULL);
-    SDL_UpdateWindowSurface(screen->window);
+/*
+ *  Show the frame in back_buffer. With a filter, the frame is handed to
+ *  the filter thread and the previous filtered frame is shown instead, if
+ *  there is one. Returns 1 if a frame was presented.
+ */
+int screen_update(struct screen *screen) {
+    if(screen->texture == NULL) {
+        return 0;
+    }
+    if(screen->filter->scale == 1) {
+        screen_upload(screen);
+        screen_present(screen);
+        return 1;
+    }
+
+    screen->filter_settling = screen->filter->settle;
+    return screen_filter_submit(screen);
+}
+
+/*
+ *  Filter the unchanged frame again while the filter's output is still
+ *  catching up with it. Call for frames that screen_update() was not.
+ *  Returns 1 if a frame was presented.
+ */
+int screen_settle(struct screen *screen) {
+    if(screen->texture == NULL || screen->filter->scale == 1 || screen->filter_settling == 0) {
+        return 0;
+    }
+    screen->filter_settling--;
+    return screen_filter_submit(screen);
+}
+
+/*
+ *  Show the last filtered frame if it is done. Call once per frame.
+ *  Returns 1 if it was presented.
+ */
+int screen_poll(struct screen *screen) {
+    if(screen->filter_busy && SDL_SemTryWait(screen->filter_done) == 0) {
+        screen->filter_busy = 0;
+        screen_filter_show(screen);
+        return 1;
+    }
+    return 0;
+}
+
+/* Show the current texture again, e.g. after the window was resized. */
+void screen_redraw(struct screen *screen) {
+    if(screen->texture != NULL) {
+        screen_present(screen);
+    }
+}
+
+int screen_set_filter(struct screen *screen, const struct filter *filter) {
+    /* Let the thread finish with the old filter first. */
+    if(screen->filter_busy) {
+        SDL_SemWait(screen->filter_done);
+        screen->filter_busy = 0;
+    }
+    if(filter->scale > 1 && screen->filter_thread == NULL && screen_filter_start(screen) != 0) {
+        screen_filter_stop(screen);
+        return -1;
+    }
+
+    Uint32 format = filter->scale > 1 ? SDL_PIXELFORMAT_ARGB8888 : SCREEN_TEXTURE_FORMAT;
+    SDL_Texture *texture = SDL_CreateTexture(screen->renderer, format, SDL_TEXTUREACCESS_STREAMING,
+        SCREEN_WIDTH * filter->scale, SCREEN_HEIGHT * filter->scale);
+    if(texture == NULL) {
+        fprintf(stderr, "screen error: failed to create texture: %s\n", SDL_GetError());
+        return -1;
+    }
+    if(screen->texture != NULL) {
+        SDL_DestroyTexture(screen->texture);
+    }
+    screen->texture = texture;
+    screen->filter = filter;
+
+    /* Start the lcd ghosting from black. */
+    if(screen->filter_out != NULL) {
+        memset(screen->filter_out, 0, SCREEN_WIDTH * SCREEN_HEIGHT * FILTER_SCALE_MAX * FILTER_SCALE_MAX *
+            sizeof(uint32_t));
+    }
+    screen_update(screen);
+    return 0;
+}
+
+/* Wait for the display's vertical blank in every present. */
+int screen_set_vsync(struct screen *screen, int vsync) {
+    if(SDL_RenderSetVSync(screen->renderer, vsync) != 0) {
+        fprintf(stderr, "screen error: can't set vsync: %s\n", SDL_GetError());
+        return -1;
+    }
+    return 0;
 }
@@ -4,24 +4,58 @@
  *
  *  Emulate a LCD screen by using SDL and blitting to a window.
  *
+ *  The GPU draws into back_buffer. screen_update() copies it into a
+ *  streaming texture once per shown frame and the renderer scales it to
+ *  the window: by the largest whole factor that fits, centered, with
+ *  black bars around it. The window can be resized freely.
+ *
+ *  With a filter (screen_set_filter) the frame is scaled up on a separate
+ *  thread while the emulation goes on, and shown at the next
+ *  screen_update() or screen_poll(). A filter that blends in the last frame
+ *  (lcd) also gets the unchanged frame while it settles, see
+ *  screen_settle().
+ *
+ *  The GPU can't draw into the locked texture directly: unchanged lines
+ *  are not redrawn, and locked texture memory does not keep the last
+ *  frame.
+ *
  */
 #ifndef GBOY_SCREEN_H
 #define GBOY_SCREEN_H
 
 #include <SDL2/SDL.h>
+#include "pixel.h"
+#include "filter.h"
 
 #define SCREEN_WIDTH    160
 #define SCREEN_HEIGHT   144
 
 struct screen {
     SDL_Window *window;
-    SDL_Surface *screen;
-    SDL_Surface *buffer;
-    uint8_t back_buffer[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
+    SDL_Renderer *renderer;
+    SDL_Texture *texture;
+
+    /* Filtering runs on its own thread, one frame behind (see filter.h). */
+    const struct filter *filter;
+    uint32_t *filter_in;
+    uint32_t *filter_out;
+    SDL_Thread *filter_thread;
+    SDL_sem *filter_ready;  /* filter_in holds a frame to filter. */
+    SDL_sem *filter_done;   /* filter_out holds a filtered frame. */
+    int filter_busy;        /* Frame handed to the thread and not shown yet. */
+    int filter_settling;    /* Unchanged frames still to filter (filter->settle). */
+    int filter_quit;
+
+    pixel_t back_buffer[PIXEL_OFFSET(SCREEN_WIDTH * SCREEN_HEIGHT)];   /* See PIXEL_FORMAT. */
 };
 
 void    screen_init(struct screen *screen);
 void    screen_cleanup(struct screen *screen);
-void    screen_update(struct screen *screen);
+int     screen_update(struct screen *screen);
+int     screen_poll(struct screen *screen);
+void    screen_redraw(struct screen *screen);
+int     screen_settle(struct screen *screen);
+int     screen_set_filter(struct screen *screen, const struct filter *filter);
+int     screen_set_vsync(struct screen *screen, int vsync);
 
 #endif
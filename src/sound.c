@@ -1,115 +1,231 @@
-#include <math.h>
-#include <stdio.h>
+#include <string.h>
 #include "sound.h"
-#include "apu.h"
 
-static float freq_to_hz(const uint16_t freq) {
-    return (4194304.0f / (32.0f * (2048.0f - freq)));
+/*
+ *  Duty cycles, the leftmost bit is step 0:
+ *
+ *      12.5%   = 0000 0001
+ *      25.0%   = 1000 0001
+ *      50.0%   = 1000 0111
+ *      75.0%   = 0111 1110
+ */
+static const uint8_t DUTY[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+/* NR32 output level to right shift: mute, 100%, 50%, 25%. */
+static const uint8_t WAVE_SHIFT[4] = { 4, 0, 1, 2 };
+
+/*** Private ***/
+
+/* New sweep frequency, turns the channel off when it overflows. */
+static uint16_t sound_sweep_calc(struct sound *sound) {
+    uint16_t delta = sound->sweep_freq >> sound->sweep_shift;
+    uint16_t freq;
+    if(sound->sweep_down) {
+        freq = sound->sweep_freq - delta;
+        sound->sweep_negated = 1;
+    } else {
+        freq = sound->sweep_freq + delta;
+    }
+    if(freq > 2047) {
+        sound->on = 0;
+    }
+    return freq;
 }
 
-static float square_wave(int sample, float freq, int duty) {
-    float period = SAMPLES_PER_SEC / freq;
-    float pos = (float)fmod(sample, period) / period;
-
-    /*
-     * 12.5%    = -1-- ---- | -1-- ----
-     * 25.0%    = 11-- ---- | 11-- ----
-     * 50.0%    = 1111 ---- | 1111 ----
-     * 75.0%    = --11 1111 | --11 1111
-     */
-    switch(duty) {
-        case 0: /* 12.5% = */
-            return (pos >= 0.125 && pos < 0.25) ? 1.0f : -1.0f;
-        case 1: /* 25.0% */
-            return (pos < 0.25) ? 1.0f : -1.0f;
-        case 2: /* 50.0% */
-            return (pos < 0.50) ? 1.0f : -1.0f;
-        case 3: /* 75.0% */
-            return (pos >= 0.25) ? 1.0f : -1.0f;
+static void sound_trigger(struct sound *sound, const int first_half) {
+    sound->on = sound->dac;
+    if(sound->len == 0) {
+        sound->len = sound->len_max;
+        if(sound->len_on && first_half) {
+            sound->len--;
+        }
     }
 
-    return 0;
+    sound->timer = sound_period(sound);
+    sound->vol = sound->env_vol;
+    sound->env_timer = sound->env_period;
+    if(sound->type == SOUND_WAVE) {
+        sound->pos = 0;
+    }
+    sound->lfsr = 0x7FFF;
+
+    if(sound->sweep) {
+        sound->sweep_freq = sound->freq;
+        sound->sweep_timer = sound->sweep_period ? sound->sweep_period : 8;
+        sound->sweep_on = sound->sweep_period != 0 || sound->sweep_shift != 0;
+        sound->sweep_negated = 0;
+        if(sound->sweep_shift != 0) {
+            sound_sweep_calc(sound);
+        }
+    }
 }
 
-void sound_set_sweep(struct sound *sound, const uint8_t b) {
-    sound->sweep_shift = b & 0x07;
-    sound->sweep_dir = b & 0x08;
-    sound->sweep_time = (b >> 4) & 0x07;
+/*** Public ***/
+
+void sound_init(struct sound *sound, enum sound_type type, const uint8_t *wave_ram) {
+    memset(sound, 0, sizeof(struct sound));
+    sound->type = type;
+    sound->len_max = (type == SOUND_WAVE) ? 256 : 64;
+    sound->wave_ram = wave_ram;
+    sound->lfsr = 0x7FFF;
+    sound->timer = sound_period(sound);
 }
 
-void sound_set_len(struct sound *sound, const uint8_t b) {
-    uint8_t len = b & 0x3F;
-    sound->len = (64 - len) * (1000.0f / 256.0f);
-    sound->duty = (b >> 6) & 0x03;
+/* Cycles between waveform steps. */
+uint32_t sound_period(const struct sound *sound) {
+    switch(sound->type) {
+        case SOUND_SQUARE:
+            return (2048u - sound->freq) * 4;
+        case SOUND_WAVE:
+            return (2048u - sound->freq) * 2;
+        case SOUND_NOISE:
+            return (sound->noise_div ? sound->noise_div * 16u : 8u) << sound->noise_shift;
+    }
+    return 0;
 }
 
-void sound_set_env(struct sound *sound, const uint8_t b) {
-    sound->env_step_len = b & 0x07;
-    sound->env_dir = b & 0x08;
-    sound->env_step_level = (b >> 4) & 0x0F;
+/* The frequency timer ran out. */
+void sound_step(struct sound *sound) {
+    sound->timer = sound_period(sound);
+    switch(sound->type) {
+        case SOUND_SQUARE:
+            sound->pos = (sound->pos + 1) & 0x07;
+            break;
+        case SOUND_WAVE:
+            sound->pos = (sound->pos + 1) & 0x1F;
+            break;
+        case SOUND_NOISE: {
+            uint16_t bit = (sound->lfsr ^ (sound->lfsr >> 1)) & 0x01;
+            sound->lfsr = (uint16_t)((sound->lfsr >> 1) | (bit << 14));
+            if(sound->noise_narrow) {
+                sound->lfsr = (uint16_t)((sound->lfsr & ~0x40) | (bit << 6));
+            }
+            break;
+        }
+    }
 }
 
-void sound_set_lo(struct sound *sound, const uint8_t b) {
-    sound->freq = (sound->freq & 0xFF00) | b;
-    sound->freq_hz = freq_to_hz(sound->freq);
+/* 4 bit DAC input. */
+uint8_t sound_output(const struct sound *sound) {
+    if(!sound->on) {
+        return 0;
+    }
+    switch(sound->type) {
+        case SOUND_SQUARE:
+            return ((DUTY[sound->duty] >> (7 - sound->pos)) & 0x01) ? sound->vol : 0;
+        case SOUND_WAVE: {
+            uint8_t b = sound->wave_ram[sound->pos >> 1];
+            uint8_t sample = (sound->pos & 0x01) ? (b & 0x0F) : (b >> 4);
+            return sample >> WAVE_SHIFT[sound->wave_vol];
+        }
+        case SOUND_NOISE:
+            return (sound->lfsr & 0x01) ? 0 : sound->vol;
+    }
+    return 0;
 }
 
-void sound_set_hi(struct sound *sound, const uint8_t b) {
-    uint8_t hi = b & 0x07;
-    sound->freq = (uint16_t)((hi << 8) | (sound->freq & 0x00FF));
-    sound->freq_hz = freq_to_hz(sound->freq);
-    sound->one_shot = b & 0x40;
-    if(b & 0x80) {
-        sound->clock = 0;
+/* 256 Hz */
+void sound_clock_len(struct sound *sound) {
+    if(sound->len_on && sound->len > 0) {
+        sound->len--;
+        if(sound->len == 0) {
+            sound->on = 0;
+        }
     }
 }
 
-void sound_update(struct sound *sound, const float ms) {
-    sound->clock += ms;
+/* 64 Hz */
+void sound_clock_env(struct sound *sound) {
+    if(sound->env_period == 0) {
+        return;
+    }
+    if(sound->env_timer > 0 && --sound->env_timer > 0) {
+        return;
+    }
+    sound->env_timer = sound->env_period;
+    if(sound->env_up && sound->vol < 15) {
+        sound->vol++;
+    } else if(!sound->env_up && sound->vol > 0) {
+        sound->vol--;
+    }
+}
 
-    if(sound->one_shot && sound->clock > sound->len) {
-        sound->on = 0;
+/* 128 Hz */
+void sound_clock_sweep(struct sound *sound) {
+    if(sound->sweep_timer > 0 && --sound->sweep_timer > 0) {
+        return;
+    }
+    sound->sweep_timer = sound->sweep_period ? sound->sweep_period : 8;
+    if(!sound->sweep_on || sound->sweep_period == 0) {
         return;
     }
 
-    sound->on = 1;
+    uint16_t freq = sound_sweep_calc(sound);
+    if(freq <= 2047 && sound->sweep_shift != 0) {
+        sound->sweep_freq = freq;
+        sound->freq = freq;
+        sound_sweep_calc(sound);
+    }
+}
+
+void sound_set_sweep(struct sound *sound, const uint8_t b) {
+    sound->sweep_period = (b >> 4) & 0x07;
+    sound->sweep_shift = b & 0x07;
 
-    /* Update sweep */
-    if(sound->sweep_time > 0) {
-        float time = sound->sweep_time / (1000.0f / 128.0f);
-        (void)time;
-        /* TODO: implement */
+    /* Back from down to up after a calculation ends the sweep. */
+    if(sound->sweep_down && !(b & 0x08) && sound->sweep_negated) {
+        sound->on = 0;
     }
+    sound->sweep_down = b & 0x08;
+}
 
-    /* Update envelope. */
-    if(sound->env_step_level == 0) {
-        sound->env_out = 0.0f;
+void sound_set_len(struct sound *sound, const uint8_t b) {
+    if(sound->type == SOUND_WAVE) {
+        sound->len = (uint16_t)(256 - b);
     } else {
-        if(sound->env_step_len == 0) {
-            sound->env_out = 1.0f;
-        } else {
-            float step_ms = sound->env_step_len * (1000.0f / 64.0f);
-            float step_val = 1.0f / sound->env_step_level;
-            int curr_step = (int)(sound->clock / step_ms);
-            if(curr_step < sound->env_step_level) {
-                if(sound->env_dir) {
-                    sound->env_out = step_val * curr_step;
-                } else {
-                    sound->env_out = 1.0f - (step_val * curr_step);
-                }
-            } else {
-                sound->env_out = sound->env_dir ? 1.0f : 0.0f;
-            }
-        }
+        sound->len = (uint16_t)(64 - (b & 0x3F));
+        sound->duty = (b >> 6) & 0x03;
+    }
+}
+
+void sound_set_env(struct sound *sound, const uint8_t b) {
+    sound->env_vol = (b >> 4) & 0x0F;
+    sound->env_up = b & 0x08;
+    sound->env_period = b & 0x07;
+    sound_set_dac(sound, (b & 0xF8) != 0);
+}
+
+void sound_set_dac(struct sound *sound, const int on) {
+    sound->dac = (uint8_t)(on != 0);
+    if(!on) {
+        sound->on = 0;
     }
 }
 
-float sound_generate(struct sound *sound, const int sample) {
-    /* Generate square wave sample. */
-    float out = square_wave(sample, sound->freq_hz, sound->duty);
+void sound_set_noise(struct sound *sound, const uint8_t b) {
+    sound->noise_shift = (b >> 4) & 0x0F;
+    sound->noise_narrow = b & 0x08;
+    sound->noise_div = b & 0x07;
+}
+
+void sound_set_lo(struct sound *sound, const uint8_t b) {
+    sound->freq = (sound->freq & 0xFF00) | b;
+}
+
+void sound_set_hi(struct sound *sound, const uint8_t b, const int first_half) {
+    sound->freq = (uint16_t)(((b & 0x07) << 8) | (sound->freq & 0x00FF));
 
-    /* Apply envelope. */
-    out *= sound->env_out;
+    /* Enabling length in the first half of a length period clocks it once. */
+    uint8_t len_on = (b & 0x40) != 0;
+    if(first_half && len_on && !sound->len_on && sound->len > 0) {
+        sound->len--;
+        if(sound->len == 0 && !(b & 0x80)) {
+            sound->on = 0;
+        }
+    }
+    sound->len_on = len_on;
 
-    return out;
+    if(b & 0x80) {
+        sound_trigger(sound, first_half);
+    }
 }
@@ -2,7 +2,22 @@
  *  sound.h
  *  =======
  *
- *  Some abstractions to make it easier to work with audio.
+ *  One sound channel, built from the units of the hardware:
+ *
+ *      SOUND_SQUARE    - channels 1 (with frequency sweep) and 2
+ *      SOUND_WAVE      - channel 3, 32 4 bit samples from wave RAM
+ *      SOUND_NOISE     - channel 4, a 15 or 7 bit LFSR
+ *
+ *  The frequency timer counts down cycles; when it runs out the waveform
+ *  steps (duty position, wave position or LFSR shift) and the timer is
+ *  reloaded with the period from the frequency registers. Length, envelope
+ *  and sweep are clocked by the frame sequencer of the APU. Everything is
+ *  integer: sound_output() is the 4 bit value going into the channel's
+ *  DAC.
+ *
+ *  Writes to NRx4 take first_half: whether the frame sequencer's next step
+ *  does not clock length, which changes how enabling length and
+ *  triggering count.
  *
  */
 #ifndef GBOY_SOUND_H
@@ -10,36 +25,64 @@
 
 #include <inttypes.h>
 
+enum sound_type {
+    SOUND_SQUARE,
+    SOUND_WAVE,
+    SOUND_NOISE,
+};
+
 struct sound {
-    uint8_t     on;
+    enum sound_type type;
+    uint8_t     sweep;          /* Has the sweep unit (channel 1). */
+    uint8_t     on;             /* Playing (NR52). */
+    uint8_t     dac;            /* DAC powered, else silent and can't be on. */
 
-    float       len;
-    uint8_t     duty;
-    uint16_t    freq;
-    float       freq_hz;
-    uint8_t     one_shot;
+    uint16_t    len;            /* Length counter, off at 0. */
+    uint16_t    len_max;        /* 64, 256 for the wave channel. */
+    uint8_t     len_on;
 
-    uint8_t     env_step_len;
-    uint8_t     env_dir;
-    uint8_t     env_step_level;
-    float       env_out;
+    uint8_t     vol;
+    uint8_t     env_vol;        /* Volume on trigger. */
+    uint8_t     env_up;
+    uint8_t     env_period;
+    uint8_t     env_timer;
 
+    uint8_t     sweep_period;
+    uint8_t     sweep_down;
     uint8_t     sweep_shift;
-    uint8_t     sweep_dir;
-    uint8_t     sweep_time;
+    uint8_t     sweep_timer;
+    uint8_t     sweep_on;
+    uint8_t     sweep_negated;  /* Calculated down since the trigger. */
+    uint16_t    sweep_freq;     /* Shadow frequency. */
 
-    float       clock;
+    uint16_t    freq;           /* 11 bit frequency register. */
+    uint32_t    timer;          /* Cycles to the next waveform step. */
+    uint8_t     duty;
+    uint8_t     pos;            /* Duty step 0-7, wave sample 0-31. */
+    uint8_t     wave_vol;       /* NR32 output level 0-3. */
+    const uint8_t *wave_ram;
 
-    uint8_t     out_so1;
-    uint8_t     out_so2;
+    uint16_t    lfsr;
+    uint8_t     noise_narrow;   /* 7 bit LFSR. */
+    uint8_t     noise_shift;
+    uint8_t     noise_div;
 };
 
-void    sound_set_sweep(struct sound *sound, const uint8_t b);
-void    sound_set_len(struct sound *sound, const uint8_t b);
-void    sound_set_env(struct sound *sound, const uint8_t b);
-void    sound_set_lo(struct sound *sound, const uint8_t b);
-void    sound_set_hi(struct sound *sound, const uint8_t b);
-void    sound_update(struct sound *sound, const float ms);
-float   sound_generate(struct sound *sound, const int sample);
+void        sound_init(struct sound *sound, enum sound_type type, const uint8_t *wave_ram);
+uint32_t    sound_period(const struct sound *sound);
+void        sound_step(struct sound *sound);
+uint8_t     sound_output(const struct sound *sound);
+
+void        sound_clock_len(struct sound *sound);
+void        sound_clock_env(struct sound *sound);
+void        sound_clock_sweep(struct sound *sound);
+
+void        sound_set_sweep(struct sound *sound, const uint8_t b);
+void        sound_set_len(struct sound *sound, const uint8_t b);
+void        sound_set_env(struct sound *sound, const uint8_t b);
+void        sound_set_dac(struct sound *sound, const int on);
+void        sound_set_noise(struct sound *sound, const uint8_t b);
+void        sound_set_lo(struct sound *sound, const uint8_t b);
+void        sound_set_hi(struct sound *sound, const uint8_t b, const int first_half);
 
 #endif
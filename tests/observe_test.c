@@ -0,0 +1,113 @@
+/*
+ *  observe_test.c
+ *  ==============
+ *
+ *  Checks observe_frame() against a plain area average of the 160x144
+ *  shades, in gray and planes mode: uniform frames, bands of shades set
+ *  by per line palettes and an edge that splits output pixels.
+ *
+ */
+#include <stdio.h>
+#include <string.h>
+#include "observe.h"
+#include "gpu.h"
+#include "screen.h"
+
+static struct gpu gpu;
+static uint8_t shade_of[SCREEN_HEIGHT][SCREEN_WIDTH];
+static uint8_t out[4 * OBSERVE_WIDTH * OBSERVE_HEIGHT];
+
+/* Overlap of [a, b) and [c, d). */
+static int overlap(const int a, const int b, const int c, const int d) {
+    int lo = a > c ? a : c;
+    int hi = b < d ? b : d;
+    return hi > lo ? hi - lo : 0;
+}
+
+/* Expected value of output pixel (ox, oy) in plane p, rounded like observe.c. */
+static int expected(const enum observe_format format, const int p, const int ox, const int oy) {
+    int sum = 0;
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        int wy = overlap(oy * SCREEN_HEIGHT, (oy + 1) * SCREEN_HEIGHT, y * OBSERVE_HEIGHT, (y + 1) * OBSERVE_HEIGHT);
+        for(int x = 0; wy > 0 && x < SCREEN_WIDTH; x++) {
+            int wx = overlap(ox * SCREEN_WIDTH, (ox + 1) * SCREEN_WIDTH, x * OBSERVE_WIDTH, (x + 1) * OBSERVE_WIDTH);
+            int s = shade_of[y][x];
+            int v = (format == OBSERVE_GRAY) ? 255 - s * 85 : (s == p ? 255 : 0);
+            sum += v * wx * wy;
+        }
+    }
+    int area = SCREEN_WIDTH * SCREEN_HEIGHT;
+    return (sum + area / 2) / area;
+}
+
+/* Background color 0 everywhere, each line's palette gives its shade... */
+static void set_bands(void) {
+    memset(gpu.lines, GPU_PAL_BG, sizeof(gpu.lines));
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        memset(gpu.line_shades[y], 0, sizeof(gpu.line_shades[y]));
+        gpu.line_shades[y][GPU_PAL_BG] = (uint8_t)(y / 36);
+        memset(shade_of[y], y / 36, SCREEN_WIDTH);
+    }
+}
+
+/* ...or the same palette, shade = color index, with colors from f(x, y). */
+static void set_colors(int (*f)(int x, int y)) {
+    for(int y = 0; y < SCREEN_HEIGHT; y++) {
+        for(int i = 0; i < 4; i++) {
+            gpu.line_shades[y][GPU_PAL_BG + i] = (uint8_t)i;
+        }
+        for(int x = 0; x < SCREEN_WIDTH; x++) {
+            int c = f(x, y) & 0x03;
+            gpu.lines[y][x] = (uint8_t)(GPU_PAL_BG + c);
+            shade_of[y][x] = (uint8_t)c;
+        }
+    }
+}
+
+static int uniform_shade;
+static int uniform(int x, int y) { (void)x; (void)y; return uniform_shade; }
+static int split(int x, int y) { (void)y; return x < 81 ? 0 : 3; }
+static int pattern(int x, int y) { return (x * 7 + y * 3 + (x * y) / 5) % 4; }
+
+static int check(const char *name, const enum observe_format format) {
+    struct observe obs;
+    if(observe_init(&obs, format, 1, 0) != 0) {
+        return 1;
+    }
+    observe_frame(&obs, &gpu, out);
+
+    int errors = 0;
+    for(int p = 0; p < obs.planes; p++) {
+        for(int oy = 0; oy < OBSERVE_HEIGHT; oy++) {
+            for(int ox = 0; ox < OBSERVE_WIDTH; ox++) {
+                int got = out[(p * OBSERVE_HEIGHT + oy) * OBSERVE_WIDTH + ox];
+                int want = expected(format, p, ox, oy);
+                if(got != want && errors++ == 0) {
+                    printf("%s %s: plane %d (%d, %d) is %d, expected %d\n", name,
+                        format == OBSERVE_GRAY ? "gray" : "planes", p, ox, oy, got, want);
+                }
+            }
+        }
+    }
+    observe_cleanup(&obs);
+    return errors != 0;
+}
+
+int main(void) {
+    int failed = 0;
+    for(int format = OBSERVE_GRAY; format <= OBSERVE_PLANES; format++) {
+        for(uniform_shade = 0; uniform_shade < 4; uniform_shade++) {
+            set_colors(uniform);
+            failed += check("uniform", (enum observe_format)format);
+        }
+        set_bands();
+        failed += check("bands", (enum observe_format)format);
+        set_colors(split);
+        failed += check("split", (enum observe_format)format);
+        set_colors(pattern);
+        failed += check("pattern", (enum observe_format)format);
+    }
+
+    printf("observe: %s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
+}